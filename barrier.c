@@ -0,0 +1,113 @@
+/**
+ * barrier.c
+ *
+ * This file contains pthread_barrier_t
+ *
+ * A barrier is an entry in the barrier table holding its count and the threads
+ * waiting at it, one list per run queue level. The last thread to arrive
+ * splices the lists onto the global run queue in one step with readyLists, so
+ * releasing the barrier costs the same however many threads wait, and it
+ * carries on without a switch.
+ */
+
+// Entry of the barrier table. The id is kept in the pthread object
+typedef struct BarrierObject {
+	int nextFree; // Link on the table's free list
+	SpinLock lock; // Guards the rest
+	unsigned int count; // Threads that have to arrive
+	unsigned int arrived; // Threads waiting now
+	WaitQueue waiters[NUM_LEVELS]; // Each thread is on the list of its top level, ready for readyLists
+} BarrierObject;
+
+// Table(map) of the barriers
+IdTable barrierTable;
+
+
+// The barrier of an id
+BarrierObject * barrierObject(int id) {
+	return (BarrierObject *) idEntry(&barrierTable, id);
+}
+
+// Wait at the barrier until count threads have. Returns PTHREAD_BARRIER_SERIAL_THREAD to the last to arrive, 0 to the others
+int barrierWait(Schedular * s, int id) {
+
+	BarrierObject * o = barrierObject(id);
+	spinLock(&o->lock);
+
+	// Not everyone is here. Wait to be released
+	if (++o->arrived < o->count) {
+		Node * self = currentWorker()->current;
+		waitQueuePush(&o->waiters[self->thread_cb->topLevel], self);
+		blockThread(s, &o->lock, BLOCK_COND);
+		return 0;
+	}
+
+	// Everyone is. Take the lists so the barrier can be used again at once, then release them all
+	WaitQueue released[NUM_LEVELS];
+	int n = o->arrived - 1;
+	int level;
+	for (level = 0; level < NUM_LEVELS; level++) {
+		released[level] = o->waiters[level];
+		o->waiters[level].head = NULL;
+		o->waiters[level].tail = NULL;
+	}
+	o->arrived = 0;
+	spinUnlock(&o->lock);
+
+	readyLists(s, released, n);
+	return PTHREAD_BARRIER_SERIAL_THREAD;
+}
+
+
+/************************ BARRIERS ****************************/
+
+
+// Initialize a barrier that lets threads through count at a time
+int pthread_barrier_init(pthread_barrier_t * barrier, const pthread_barrierattr_t * attr, unsigned int count) {
+
+	if (count == 0) return EINVAL;
+
+	if (schedularCreated == 0) initSchedular();
+
+	int id = idAlloc(&barrierTable);
+	if (id == -1) return ENOMEM;
+
+	BarrierObject * o = barrierObject(id);
+	o->count = count;
+	o->arrived = 0;
+
+	// Set the index(id) for the barrier. for where it is in the barrier table
+	barrier->__align = id;
+	return 0;
+}
+
+// Destroy the barrier, giving its id back. Returns EBUSY while threads wait at it
+int pthread_barrier_destroy(pthread_barrier_t * barrier) {
+
+	int id = (int) barrier->__align;
+	if (id == 0) return EINVAL;
+
+	preemptDisable();
+	BarrierObject * o = barrierObject(id);
+	spinLock(&o->lock);
+	if (o->arrived != 0) {
+		spinUnlock(&o->lock);
+		preemptEnable();
+		return EBUSY;
+	}
+	spinUnlock(&o->lock);
+
+	barrier->__align = 0;
+	idFree(&barrierTable, id);
+	preemptEnable();
+	return 0;
+}
+
+// Wait until count threads have reached the barrier. One of them gets PTHREAD_BARRIER_SERIAL_THREAD
+int pthread_barrier_wait(pthread_barrier_t * barrier) {
+
+	preemptDisable();
+	int ret = barrierWait(schedular, (int) barrier->__align);
+	preemptEnable();
+	return ret;
+}
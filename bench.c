@@ -0,0 +1,267 @@
+/**
+ * bench.c
+ *
+ * This file contains the microbenchmarks run by make bench
+ *
+ * The same source is linked against this library (bench_ult) and against the
+ * system's pthreads (bench_nptl), so the two can be compared line by line.
+ * Each benchmark is timed in SAMPLES batches and reports the mean cost of one
+ * operation, operations per second, and the median, 90th percentile and
+ * maximum of the batch means. These show how steady a benchmark is from batch
+ * to batch, not the latency of single operations, which would cost more to
+ * time than the cheapest of them take.
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Constants
+#define SAMPLES 50 // Batches timed per benchmark
+#define NUM_WAITERS 8 // Threads woken by each broadcast
+
+// Newer glibc only keeps pthread_yield for old binaries, so the native build yields with sched_yield like it did
+#ifdef BENCH_NATIVE
+#define IMPL "nptl"
+#define pthread_yield sched_yield
+#else
+#define IMPL "ult"
+int pthread_yield(void); // Declared by pthread.h only with _GNU_SOURCE
+#endif
+
+
+// Nanoseconds per operation of each batch of the running benchmark
+double samples[SAMPLES];
+
+// Vals for the thread pairs
+pthread_mutex_t mutex;
+pthread_cond_t cond;
+pthread_cond_t ready; // Broadcast waiters tell the broadcaster they are waiting
+volatile int turn; // Whose go it is in the ping-pongs
+volatile long counter;
+volatile int stop;
+long batch; // Operations per batch
+
+// Vals for broadcast
+volatile int waiting; // Waiters back on the cond. var since the last broadcast
+volatile int broadcasts; // Broadcasts so far
+
+
+// Monotonic time in nanoseconds
+long nowNs(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+// Sort helper for the percentiles
+int compareDouble(const void * a, const void * b) {
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+// Print one result line from the SAMPLES batch means in samples
+void report(const char * name) {
+
+	double sum = 0;
+	int i;
+	for (i = 0; i < SAMPLES; i++) sum += samples[i];
+	double mean = sum / SAMPLES;
+
+	qsort(samples, SAMPLES, sizeof(double), compareDouble);
+
+	printf("%-5s %-22s %10.1f %14.0f %10.1f %10.1f %10.1f\n", IMPL, name, mean, 1e9 / mean,
+		samples[SAMPLES / 2], samples[SAMPLES * 9 / 10], samples[SAMPLES - 1]);
+}
+
+
+/************************ BENCHMARKS ****************************/
+
+
+// Two threads yield to each other. One op is one yield
+void * yielder(void * arg) {
+	long i;
+	for (i = 0; i < batch; i++) pthread_yield();
+	return NULL;
+}
+
+void benchYield(void) {
+	batch = 10000;
+	int s;
+	for (s = 0; s < SAMPLES; s++) {
+		pthread_t a, b;
+		long start = nowNs();
+		pthread_create(&a, NULL, yielder, NULL);
+		pthread_create(&b, NULL, yielder, NULL);
+		pthread_join(a, NULL);
+		pthread_join(b, NULL);
+		samples[s] = (double) (nowNs() - start) / (2 * batch);
+	}
+	report("yield ping-pong");
+}
+
+// Create a thread that does nothing and join it
+void * noop(void * arg) {
+	return arg;
+}
+
+void benchCreateJoin(void) {
+	batch = 1000;
+	int s;
+	for (s = 0; s < SAMPLES; s++) {
+		long start = nowNs();
+		long i;
+		for (i = 0; i < batch; i++) {
+			pthread_t t;
+			pthread_create(&t, NULL, noop, NULL);
+			pthread_join(t, NULL);
+		}
+		samples[s] = (double) (nowNs() - start) / batch;
+	}
+	report("create+join");
+}
+
+// Lock and unlock a mutex nobody else wants
+void benchUncontended(void) {
+	batch = 100000;
+	int s;
+	for (s = 0; s < SAMPLES; s++) {
+		long start = nowNs();
+		long i;
+		for (i = 0; i < batch; i++) {
+			pthread_mutex_lock(&mutex);
+			counter++;
+			pthread_mutex_unlock(&mutex);
+		}
+		samples[s] = (double) (nowNs() - start) / batch;
+	}
+	report("mutex uncontended");
+}
+
+// Two threads take turns holding the mutex. Yielding while holding it makes every lock wait for the other's unlock
+void * handoffer(void * arg) {
+	long i;
+	for (i = 0; i < batch; i++) {
+		pthread_mutex_lock(&mutex);
+		counter++;
+		pthread_yield();
+		pthread_mutex_unlock(&mutex);
+	}
+	return NULL;
+}
+
+void benchHandoff(void) {
+	batch = 2000;
+	int s;
+	for (s = 0; s < SAMPLES; s++) {
+		pthread_t a, b;
+		long start = nowNs();
+		pthread_create(&a, NULL, handoffer, NULL);
+		pthread_create(&b, NULL, handoffer, NULL);
+		pthread_join(a, NULL);
+		pthread_join(b, NULL);
+		samples[s] = (double) (nowNs() - start) / (2 * batch);
+	}
+	report("mutex contended");
+}
+
+// Two threads signal each other in turn. One op is one round trip
+void * ponger(void * arg) {
+	int me = (int) (long) arg;
+	long i;
+	pthread_mutex_lock(&mutex);
+	for (i = 0; i < batch; i++) {
+		while (turn != me) pthread_cond_wait(&cond, &mutex);
+		turn = !me;
+		pthread_cond_signal(&cond);
+	}
+	pthread_mutex_unlock(&mutex);
+	return NULL;
+}
+
+void benchCondPingPong(void) {
+	batch = 2000;
+	int s;
+	for (s = 0; s < SAMPLES; s++) {
+		pthread_t a, b;
+		turn = 0;
+		long start = nowNs();
+		pthread_create(&a, NULL, ponger, (void *) 0L);
+		pthread_create(&b, NULL, ponger, (void *) 1L);
+		pthread_join(a, NULL);
+		pthread_join(b, NULL);
+		samples[s] = (double) (nowNs() - start) / batch;
+	}
+	report("cond ping-pong");
+}
+
+// Wait for every broadcast until told to stop
+void * broadcastWaiter(void * arg) {
+	pthread_mutex_lock(&mutex);
+	int seen = broadcasts;
+	while (1) {
+		if (++waiting == NUM_WAITERS) pthread_cond_signal(&ready);
+		while (broadcasts == seen && !stop) pthread_cond_wait(&cond, &mutex);
+		if (stop) break;
+		seen = broadcasts;
+	}
+	pthread_mutex_unlock(&mutex);
+	return NULL;
+}
+
+// Broadcast to NUM_WAITERS threads and wait for all of them to wake and wait again. One op is one broadcast
+void benchBroadcast(void) {
+
+	pthread_t t[NUM_WAITERS];
+	int i;
+	stop = 0;
+	waiting = 0;
+	broadcasts = 0;
+	for (i = 0; i < NUM_WAITERS; i++) pthread_create(&t[i], NULL, broadcastWaiter, NULL);
+
+	batch = 200;
+	int s;
+	pthread_mutex_lock(&mutex);
+	for (s = 0; s < SAMPLES; s++) {
+		long start = nowNs();
+		long j;
+		for (j = 0; j < batch; j++) {
+			while (waiting < NUM_WAITERS) pthread_cond_wait(&ready, &mutex);
+			waiting = 0;
+			broadcasts++;
+			pthread_cond_broadcast(&cond);
+		}
+		samples[s] = (double) (nowNs() - start) / batch;
+	}
+	stop = 1;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&mutex);
+
+	for (i = 0; i < NUM_WAITERS; i++) pthread_join(t[i], NULL);
+
+	char name[32];
+	snprintf(name, sizeof(name), "broadcast to %d", NUM_WAITERS);
+	report(name);
+}
+
+
+int main(int argc, char ** argv) {
+
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&cond, NULL);
+	pthread_cond_init(&ready, NULL);
+
+	printf("%-5s %-22s %10s %14s %10s %10s %10s\n", "impl", "benchmark", "ns/op", "ops/sec", "batch p50", "batch p90", "batch max");
+
+	benchYield();
+	benchCreateJoin();
+	benchUncontended();
+	benchHandoff();
+	benchCondPingPong();
+	benchBroadcast();
+
+	return 0;
+}
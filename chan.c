@@ -0,0 +1,377 @@
+/**
+ * chan.c
+ *
+ * This file contains the channels behind ult_chan_send, ult_chan_recv and ult_select
+ *
+ * A channel is a ring buffer of up to capacity elements, or a rendezvous when
+ * the capacity is 0, with a queue of parked senders and one of parked
+ * receivers. A thread that has to wait puts a ChanWaiter, which lives on its
+ * stack and points at the value it sends or the place it receives into, on
+ * the channel's queue and blocks. The thread that completes its operation
+ * copies the value straight between the two threads' buffers, so an element
+ * only goes through the ring when nobody is waiting for it.
+ *
+ * ult_select waits with one ChanWaiter on each of its channels. Whoever first
+ * claims the thread through its Node's waitState gets it, others skip its
+ * waiters, and it takes the ones left over off their queues when it wakes.
+ * Send and receive are a select of one case.
+ *
+ * Completing a rendezvous on an unbuffered channel switches straight to the
+ * thread that was waiting, which usually wants the value at once.
+ */
+
+
+// A thread parked on a channel queue for one case of its select
+typedef struct ChanWaiter {
+	struct ChanWaiter * next;
+	struct ChanWaiter * prev;
+	Node * thread;
+	void * elem; // Value to send, or where to put the one received
+	int index; // Its case
+	int queued; // On the channel queue. Guarded by the channel's lock
+	struct SelectWait * wait;
+} ChanWaiter;
+
+// What the thread that claimed a waiting select left for it
+typedef struct SelectWait {
+	int fired; // Case that went ahead
+	int err; // 0, or EPIPE if its channel was closed
+} SelectWait;
+
+// FIFO of ChanWaiters
+typedef struct ChanQueue {
+	ChanWaiter * head;
+	ChanWaiter * tail;
+} ChanQueue;
+
+struct ult_chan {
+	SpinLock lock; // Guards the rest
+	size_t elemSize;
+	size_t capacity; // Elements the ring holds, 0 for a rendezvous
+	size_t first; // Ring index of the oldest element
+	size_t count; // Elements in the ring
+	int closed;
+	ChanQueue senders; // Only waiting while the ring is full
+	ChanQueue receivers; // Only waiting while the ring is empty
+	char buffer[]; // The ring
+};
+
+// Round robin start of the cases a select looks at first, so none of them is starved
+__thread unsigned int selectStart;
+
+
+// Add w to the back of q
+void chanQueuePush(ChanQueue * q, ChanWaiter * w) {
+	w->next = NULL;
+	w->prev = q->tail;
+	if (q->tail == NULL) q->head = w;
+	else q->tail->next = w;
+	q->tail = w;
+	w->queued = 1;
+}
+
+// Take w off q
+void chanQueueRemove(ChanQueue * q, ChanWaiter * w) {
+	if (w->prev == NULL) q->head = w->next;
+	else w->prev->next = w->next;
+	if (w->next == NULL) q->tail = w->prev;
+	else w->next->prev = w->prev;
+	w->queued = 0;
+}
+
+// Take the first waiter off q whose thread we can claim, dropping those another channel has claimed. NULL if there is none
+ChanWaiter * claimWaiter(ChanQueue * q) {
+
+	ChanWaiter * w;
+	while ((w = q->head) != NULL) {
+		chanQueueRemove(q, w);
+		unsigned int st = w->thread->waitState;
+		if ((st & WAIT_STATE_MASK) == WAIT_WAITING && __atomic_compare_exchange_n(&w->thread->waitState, &st, (st & ~WAIT_STATE_MASK) | WAIT_WOKEN, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) return w;
+	}
+	return NULL;
+}
+
+// Tell the thread of a claimed waiter which case went ahead
+void fireWaiter(ChanWaiter * w, int err) {
+	w->wait->fired = w->index;
+	w->wait->err = err;
+}
+
+// Make the thread of a claimed waiter runnable, or run it at once if direct. Call with no channel locks held
+void wakeWaiter(Schedular * s, Node * n, int direct) {
+
+	// It holds parkLock until it is switched out
+	spinLock(&n->parkLock);
+	spinUnlock(&n->parkLock);
+
+	if (direct) switchToThread(s, n);
+	else readyThread(s, n);
+}
+
+// Do the case c if it can go ahead without waiting. Call with its channel's lock held. Returns 1 if it did, setting
+// c->err, and *woken to a thread it claimed, if any, which *direct says to switch to. Returns 0 if it has to wait
+int tryCase(struct ult_select_case * c, Node ** woken, int * direct) {
+
+	ult_chan_t * ch = c->chan;
+	ChanWaiter * w;
+	c->err = 0;
+
+	if (c->op == ULT_CHAN_SEND) {
+		if (ch->closed) {
+			c->err = EPIPE;
+			return 1;
+		}
+
+		// Nothing is in the ring when anyone waits to receive, so hand it over
+		if ((w = claimWaiter(&ch->receivers)) != NULL) {
+			memcpy(w->elem, c->elem, ch->elemSize);
+			fireWaiter(w, 0);
+			*woken = w->thread;
+			*direct = ch->capacity == 0;
+			return 1;
+		}
+
+		if (ch->count < ch->capacity) {
+			memcpy(ch->buffer + ((ch->first + ch->count) % ch->capacity) * ch->elemSize, c->elem, ch->elemSize);
+			ch->count++;
+			return 1;
+		}
+		return 0;
+	}
+
+	// Oldest first. A full ring may have a sender waiting to take the room we leave
+	if (ch->count > 0) {
+		memcpy(c->elem, ch->buffer + ch->first * ch->elemSize, ch->elemSize);
+		ch->first = (ch->first + 1) % ch->capacity;
+		ch->count--;
+
+		if ((w = claimWaiter(&ch->senders)) != NULL) {
+			memcpy(ch->buffer + ((ch->first + ch->count) % ch->capacity) * ch->elemSize, w->elem, ch->elemSize);
+			ch->count++;
+			fireWaiter(w, 0);
+			*woken = w->thread;
+		}
+		return 1;
+	}
+
+	// A rendezvous. Take it straight from the sender
+	if ((w = claimWaiter(&ch->senders)) != NULL) {
+		memcpy(c->elem, w->elem, ch->elemSize);
+		fireWaiter(w, 0);
+		*woken = w->thread;
+		*direct = 1;
+		return 1;
+	}
+
+	if (ch->closed) {
+		memset(c->elem, 0, ch->elemSize);
+		c->err = EPIPE;
+		return 1;
+	}
+	return 0;
+}
+
+// Lock the n channels of locks, which are sorted and distinct, in order
+void lockChannels(ult_chan_t ** locks, int n) {
+	int i;
+	for (i = 0; i < n; i++) spinLock(&locks[i]->lock);
+}
+
+void unlockChannels(ult_chan_t ** locks, int n) {
+	int i;
+	for (i = n - 1; i >= 0; i--) spinUnlock(&locks[i]->lock);
+}
+
+// Carry out one of the n cases, waiting until one can go ahead if block is set. Returns the index of the
+// case, or -1 if none can go ahead without waiting. Call with preemption disabled
+int selectCases(Schedular * s, struct ult_select_case * cases, int n, int block) {
+
+	// Every channel is locked while we look, in address order so two selects can't deadlock
+	ult_chan_t * locks[n];
+	int numLocks = 0;
+	int i, j;
+	for (i = 0; i < n; i++) {
+		ult_chan_t * ch = cases[i].chan;
+		if (ch == NULL) continue;
+		for (j = numLocks; j > 0 && locks[j - 1] > ch; j--);
+		if (j > 0 && locks[j - 1] == ch) continue;
+		memmove(&locks[j + 1], &locks[j], (numLocks - j) * sizeof(ult_chan_t *));
+		locks[j] = ch;
+		numLocks++;
+	}
+	if (numLocks == 0) return -1;
+
+	lockChannels(locks, numLocks);
+
+	int start = selectStart++ % n;
+	for (j = 0; j < n; j++) {
+		i = (start + j) % n;
+		if (cases[i].chan == NULL) continue;
+
+		Node * woken = NULL;
+		int direct = 0;
+		if (tryCase(&cases[i], &woken, &direct)) {
+			unlockChannels(locks, numLocks);
+			if (woken != NULL) wakeWaiter(s, woken, direct);
+			return i;
+		}
+	}
+
+	if (!block) {
+		unlockChannels(locks, numLocks);
+		return -1;
+	}
+
+	// Wait on every channel. The wait has no queue of its own, so the timer would leave it alone
+	Node * self = currentWorker()->current;
+	ChanWaiter waiters[n];
+	SelectWait wait;
+
+	self->waitState = (self->waitState & ~WAIT_STATE_MASK) + (1 << 2) + WAIT_WAITING;
+	self->waitLock = &self->parkLock;
+	self->waitQueue = NULL;
+
+	for (i = 0; i < n; i++) {
+		ult_chan_t * ch = cases[i].chan;
+		if (ch == NULL) continue;
+		waiters[i].thread = self;
+		waiters[i].elem = cases[i].elem;
+		waiters[i].index = i;
+		waiters[i].wait = &wait;
+		chanQueuePush(cases[i].op == ULT_CHAN_SEND ? &ch->senders : &ch->receivers, &waiters[i]);
+	}
+
+	// Whoever claims us waits for parkLock, so it can't make us runnable before we are switched out
+	spinLock(&self->parkLock);
+	unlockChannels(locks, numLocks);
+	blockThread(s, &self->parkLock, BLOCK_COND);
+
+	// The claiming thread took its waiter off. Take the rest off before they go out of scope
+	if (n > 1) {
+		lockChannels(locks, numLocks);
+		for (i = 0; i < n; i++) {
+			ult_chan_t * ch = cases[i].chan;
+			if (ch == NULL || !waiters[i].queued) continue;
+			chanQueueRemove(cases[i].op == ULT_CHAN_SEND ? &ch->senders : &ch->receivers, &waiters[i]);
+		}
+		unlockChannels(locks, numLocks);
+	}
+
+	cases[wait.fired].err = wait.err;
+	return wait.fired;
+}
+
+
+/************************ CHANNELS ****************************/
+
+
+// Make a channel of elements of elemSize bytes holding up to capacity of them. Returns 0, or ENOMEM
+int ult_chan_create(ult_chan_t ** chan, size_t elemSize, size_t capacity) {
+
+	if (capacity != 0 && elemSize > ((size_t) -1 - sizeof(ult_chan_t)) / capacity) return ENOMEM;
+
+	if (schedularCreated == 0) initSchedular();
+
+	// Inside a critical section so a thread preempted in malloc can't be entered again on this worker
+	preemptDisable();
+	ult_chan_t * ch = (ult_chan_t *) calloc(1, sizeof(ult_chan_t) + elemSize * capacity);
+	preemptEnable();
+	if (ch == NULL) return ENOMEM;
+
+	ch->elemSize = elemSize;
+	ch->capacity = capacity;
+	*chan = ch;
+	return 0;
+}
+
+// Free a channel. Returns 0, or EBUSY while threads wait on it
+int ult_chan_destroy(ult_chan_t * chan) {
+
+	preemptDisable();
+	spinLock(&chan->lock);
+	if (chan->senders.head != NULL || chan->receivers.head != NULL) {
+		spinUnlock(&chan->lock);
+		preemptEnable();
+		return EBUSY;
+	}
+	spinUnlock(&chan->lock);
+
+	free(chan);
+	preemptEnable();
+	return 0;
+}
+
+// Close a channel. Waiting receivers get EPIPE, and so do waiting senders, whose values are dropped.
+// Elements already in the ring can still be received. Returns 0, or EPIPE if it was closed already
+int ult_chan_close(ult_chan_t * chan) {
+
+	preemptDisable();
+	spinLock(&chan->lock);
+	if (chan->closed) {
+		spinUnlock(&chan->lock);
+		preemptEnable();
+		return EPIPE;
+	}
+	chan->closed = 1;
+
+	// Claim them all, then wake them once the lock is dropped. Their waiters are gone as soon as they run
+	Node * woken[16];
+	int numWoken = 0;
+	ChanWaiter * w;
+	while (1) {
+		while (numWoken < 16 && (w = claimWaiter(&chan->receivers)) != NULL) {
+			memset(w->elem, 0, chan->elemSize);
+			fireWaiter(w, EPIPE);
+			woken[numWoken++] = w->thread;
+		}
+		while (numWoken < 16 && (w = claimWaiter(&chan->senders)) != NULL) {
+			fireWaiter(w, EPIPE);
+			woken[numWoken++] = w->thread;
+		}
+		if (numWoken == 0) break;
+
+		spinUnlock(&chan->lock);
+		int i;
+		for (i = 0; i < numWoken; i++) wakeWaiter(schedular, woken[i], 0);
+		numWoken = 0;
+		spinLock(&chan->lock);
+	}
+	spinUnlock(&chan->lock);
+
+	preemptEnable();
+	return 0;
+}
+
+// Send the element at elem, waiting for room or, on an unbuffered channel, for a receiver. Returns 0, or EPIPE once closed
+int ult_chan_send(ult_chan_t * chan, const void * elem) {
+
+	struct ult_select_case c = { chan, ULT_CHAN_SEND, (void *) elem, 0 };
+
+	preemptDisable();
+	selectCases(schedular, &c, 1, 1);
+	preemptEnable();
+	return c.err;
+}
+
+// Receive an element into elem, waiting for one. Returns 0, or EPIPE once closed and empty, with elem zeroed
+int ult_chan_recv(ult_chan_t * chan, void * elem) {
+
+	struct ult_select_case c = { chan, ULT_CHAN_RECV, elem, 0 };
+
+	preemptDisable();
+	selectCases(schedular, &c, 1, 1);
+	preemptEnable();
+	return c.err;
+}
+
+// Carry out whichever of the n cases can go ahead first, waiting for one unless block is 0. Cases with a NULL
+// channel are skipped. Returns the index of the case, whose err is set, or -1 if none could go ahead
+int ult_select(struct ult_select_case * cases, int n, int block) {
+
+	if (n <= 0) return -1;
+
+	preemptDisable();
+	int i = selectCases(schedular, cases, n, block);
+	preemptEnable();
+	return i;
+}
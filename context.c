@@ -0,0 +1,158 @@
+/**
+ * context.c
+ *
+ * This file contains the context switch used by the thread library
+ *
+ * On x86-64 and aarch64 a switch only saves the callee-saved registers on the
+ * old stack and swaps stack pointers. Everything else is already saved by the
+ * C calling convention, and no signal mask is touched so there is no syscall.
+ * Build with -DUSE_UCONTEXT (make CONTEXT=ucontext) to use makecontext and
+ * swapcontext instead.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <ucontext.h>
+
+#if defined(USE_UCONTEXT) || !(defined(__x86_64__) || defined(__aarch64__))
+
+// Saved execution state of a thread
+typedef ucontext_t Context;
+
+// Initialise c so switching to it calls entry on the given stack. entry must never return
+void makeContext(Context * c, void * stack, size_t size, void (*entry)(void)) {
+	getcontext(c);
+	c->uc_link = NULL;
+	c->uc_stack.ss_sp = stack;
+	c->uc_stack.ss_size = size;
+	makecontext(c, entry, 0);
+}
+
+// Save the running context in from and resume to
+void switchContext(Context * from, Context * to) {
+	swapcontext(from, to);
+}
+
+// Stack pointer a switched out context resumes with, or NULL where it can't be read. Nothing below it is in use
+void * contextSp(Context * c) {
+#if defined(__x86_64__) && defined(REG_RSP)
+	return (void *) c->uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+	return (void *) c->uc_mcontext.sp;
+#else
+	return NULL;
+#endif
+}
+
+#else
+
+// Saved execution state of a thread. The registers live on the thread's own stack
+typedef struct Context {
+	void * sp;
+} Context;
+
+// Save the running context in from and resume to
+void switchContext(Context * from, Context * to);
+
+// Stack pointer a switched out context resumes with. Nothing below it is in use
+void * contextSp(Context * c) {
+	return c->sp;
+}
+
+#if defined(__x86_64__)
+
+// Frame: mxcsr and x87 control word, r15, r14, r13, r12, rbx, rbp, return address
+__asm__(
+	".text\n"
+	".globl switchContext\n"
+	".type switchContext, @function\n"
+	"switchContext:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq (%rsi), %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size switchContext, .-switchContext\n"
+);
+
+// Initialise c so switching to it calls entry on the given stack. entry must never return
+void makeContext(Context * c, void * stack, size_t size, void (*entry)(void)) {
+
+	void ** sp = (void **) (((uintptr_t) stack + size) & ~(uintptr_t) 15);
+
+	*--sp = NULL; // Return address of entry, leaves the stack aligned as if entry was called
+	*--sp = (void *) entry; // switchContext returns here
+	for (int i = 0; i < 6; i++) *--sp = NULL; // rbp, rbx, r12 - r15
+	*--sp = (void *) (0x1F80 | ((uintptr_t) 0x037F << 32)); // Default mxcsr and x87 control word
+
+	c->sp = sp;
+}
+
+#else
+
+// Frame: x19 - x28, x29, x30, d8 - d15
+__asm__(
+	".text\n"
+	".globl switchContext\n"
+	".type switchContext, %function\n"
+	"switchContext:\n"
+	"	sub sp, sp, #160\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mov x9, sp\n"
+	"	str x9, [x0]\n"
+	"	ldr x9, [x1]\n"
+	"	mov sp, x9\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	add sp, sp, #160\n"
+	"	ret\n"
+	".size switchContext, .-switchContext\n"
+);
+
+// Initialise c so switching to it calls entry on the given stack. entry must never return
+void makeContext(Context * c, void * stack, size_t size, void (*entry)(void)) {
+
+	void ** sp = (void **) (((uintptr_t) stack + size) & ~(uintptr_t) 15);
+
+	sp -= 20;
+	for (int i = 0; i < 20; i++) sp[i] = NULL;
+	sp[11] = (void *) entry; // x30, switchContext returns here
+
+	c->sp = sp;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,100 @@
+/**
+ * idtable.c
+ *
+ * This file contains the growable tables that map small integer ids to the
+ * thread slots, mutexes and cond. vars behind them
+ *
+ * A table is a directory of fixed size chunks that are mapped the first time
+ * an id in them is handed out, so looking an id up is two loads and the table
+ * only costs memory for the ids in use. Freed ids go on a FIFO free list and
+ * are handed out again oldest first. Chunks are never unmapped, so an entry
+ * stays readable after its id is freed.
+ *
+ * Every entry type starts with an int the table links free entries through.
+ *
+ * Uses SpinLock from spinlock.c
+ */
+#include <sys/mman.h>
+
+// Constants
+#define ID_CHUNK_BITS 12 // Entries per chunk is 1 << this
+#define ID_CHUNK_SIZE (1 << ID_CHUNK_BITS)
+#define MAX_ID_CHUNKS (1 << 16)
+#define MAX_IDS (MAX_ID_CHUNKS * ID_CHUNK_SIZE)
+
+
+typedef struct IdTable {
+	SpinLock lock; // Guards growing and the free list
+	size_t entrySize;
+	int freeHead; // Freed ids, linked through the first int of their entries. -1 when empty
+	int freeTail;
+	volatile int nextUnused; // Ids from here on have never been handed out
+	char * chunks[MAX_ID_CHUNKS]; // Only written before nextUnused moves past them
+} IdTable;
+
+
+// Set up an empty table of entries of the given size. Ids below firstId are never handed out
+void idTableInit(IdTable * t, size_t entrySize, int firstId) {
+	t->lock.locked = 0;
+	t->entrySize = entrySize;
+	t->freeHead = -1;
+	t->freeTail = -1;
+	t->nextUnused = firstId;
+}
+
+// The entry of an id that has been handed out. No bounds check
+void * idEntry(IdTable * t, int id) {
+	return t->chunks[id >> ID_CHUNK_BITS] + (size_t) (id & (ID_CHUNK_SIZE - 1)) * t->entrySize;
+}
+
+// The entry of an id from outside the library, or NULL if no id that large has been handed out
+void * idLookup(IdTable * t, int id) {
+	if (id < 0 || id >= __atomic_load_n(&t->nextUnused, __ATOMIC_ACQUIRE)) return NULL;
+	return idEntry(t, id);
+}
+
+// Take an id, reusing the longest freed one first. Returns -1 if memory or ids have run out
+int idAlloc(IdTable * t) {
+
+	spinLock(&t->lock);
+
+	int id = t->freeHead;
+	if (id != -1) {
+		t->freeHead = *(int *) idEntry(t, id);
+		if (t->freeHead == -1) t->freeTail = -1;
+		spinUnlock(&t->lock);
+		return id;
+	}
+
+	id = t->nextUnused;
+	if (id >= MAX_IDS) {
+		spinUnlock(&t->lock);
+		return -1;
+	}
+
+	// First id of a new chunk. mmap so a preempted malloc is never entered again, and so entries start zeroed
+	int c = id >> ID_CHUNK_BITS;
+	if (t->chunks[c] == NULL) {
+		void * chunk = mmap(NULL, ID_CHUNK_SIZE * t->entrySize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (chunk == MAP_FAILED) {
+			spinUnlock(&t->lock);
+			return -1;
+		}
+		t->chunks[c] = (char *) chunk;
+	}
+
+	__atomic_store_n(&t->nextUnused, id + 1, __ATOMIC_RELEASE);
+	spinUnlock(&t->lock);
+	return id;
+}
+
+// Give an id back to go to the back of the free list
+void idFree(IdTable * t, int id) {
+
+	spinLock(&t->lock);
+	*(int *) idEntry(t, id) = -1;
+	if (t->freeTail == -1) t->freeHead = id;
+	else *(int *) idEntry(t, t->freeTail) = id;
+	t->freeTail = id;
+	spinUnlock(&t->lock);
+}
@@ -0,0 +1,351 @@
+/**
+ * io.c
+ *
+ * This file contains the I/O reactor behind ult_read, ult_write, ult_accept and ult_connect
+ *
+ * The wrappers put their fd in non-blocking mode and, when the call would
+ * block, park only the calling green thread on a per-fd wait queue. Every fd
+ * is registered edge-triggered with one epoll instance. Workers poll it
+ * without blocking while there are threads to run, and an idle worker blocks
+ * in epoll_wait until an fd is ready or another worker wakes it through an
+ * eventfd.
+ *
+ * Each fd has a sequence number per direction that the poller bumps on every
+ * edge. A thread reads it before trying the call and only parks if it has not
+ * changed, so an edge that arrives in between is never lost.
+ */
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+// Constants
+#define MAX_NUM_FDS (1 << 20) // Entries in the fd table
+#define MAX_IO_EVENTS 64 // Events taken per epoll_wait
+
+// Directions a thread can wait in
+#define FD_READ 0
+#define FD_WRITE 1
+
+
+// Threads waiting on one fd
+typedef struct FdWaiters {
+	SpinLock lock; // Guards the queues and sequence numbers
+	WaitQueue waiters[2]; // Indexed by FD_READ or FD_WRITE
+	volatile unsigned int seq[2]; // Edges seen in each direction
+	int nonblocking; // O_NONBLOCK has been set. Cleared by ult_close
+} FdWaiters;
+
+
+// Reactor state
+SpinLock reactorLock; // Guards starting the reactor
+volatile int reactorStarted = 0;
+int epollFd = -1;
+int wakeFd = -1; // eventfd a blocked poller also waits on
+SpinLock pollLock; // Only one worker polls at a time
+volatile int pollerBlocked = 0; // A worker is blocked in epoll_wait
+FdWaiters * fdTable; // Indexed by fd. Only the entries in use cost memory
+
+// sys/socket.h only declares accept4 with _GNU_SOURCE, which pthread.c can't define
+int accept4(int fd, struct sockaddr * addr, socklen_t * addrlen, int flags);
+
+// Implemented in pthread.c
+void initSchedular(void);
+void preemptDisable(void);
+void preemptEnable(void);
+extern int schedularCreated;
+extern Schedular * schedular;
+
+
+// Create the epoll instance, the wake up eventfd and the fd table. Returns 0 or an errno value
+int startReactor(void) {
+
+	if (reactorStarted) return 0;
+
+	spinLock(&reactorLock);
+	if (!reactorStarted) {
+
+		void * table = mmap(NULL, MAX_NUM_FDS * sizeof(FdWaiters), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (table == MAP_FAILED) {
+			spinUnlock(&reactorLock);
+			return ENOMEM;
+		}
+
+		epollFd = epoll_create1(EPOLL_CLOEXEC);
+		wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (epollFd < 0 || wakeFd < 0) {
+			int err = errno;
+			if (epollFd >= 0) close(epollFd);
+			if (wakeFd >= 0) close(wakeFd);
+			munmap(table, MAX_NUM_FDS * sizeof(FdWaiters));
+			spinUnlock(&reactorLock);
+			return err;
+		}
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.fd = wakeFd;
+		epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev);
+
+		fdTable = (FdWaiters *) table;
+		__atomic_store_n(&reactorStarted, 1, __ATOMIC_RELEASE);
+	}
+	spinUnlock(&reactorLock);
+
+	return 0;
+}
+
+// The wait queues of fd with the fd in non-blocking mode, or NULL if the reactor can't handle it
+FdWaiters * fdWaiters(int fd) {
+
+	if (fd < 0 || fd >= MAX_NUM_FDS) return NULL;
+
+	if (schedularCreated == 0) initSchedular();
+	if (startReactor() != 0) return NULL;
+
+	FdWaiters * f = &fdTable[fd];
+	if (!f->nonblocking) {
+		int flags = fcntl(fd, F_GETFL);
+		if (flags < 0) return NULL;
+		if (!(flags & O_NONBLOCK)) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+		f->nonblocking = 1;
+	}
+
+	return f;
+}
+
+// Make every thread waiting on fd in a direction runnable. Call with f's lock held
+void wakeFdWaiters(Schedular * s, FdWaiters * f, int dir) {
+
+	f->seq[dir]++;
+
+	Node * n;
+	while ((n = waitQueuePop(&f->waiters[dir])) != NULL) {
+		__atomic_sub_fetch(&s->numParked, 1, __ATOMIC_SEQ_CST);
+		readyThread(s, n);
+	}
+}
+
+// Park the calling thread until fd is ready in direction dir, unless an edge has come since seq was read.
+// Returns 0 to try the call again, or an errno value
+int waitFd(Schedular * s, int fd, FdWaiters * f, int dir, unsigned int seq) {
+
+	preemptDisable();
+
+	Node * self = currentWorker()->current;
+
+	spinLock(&f->lock);
+
+	// Adding it every time keeps the registration right after the fd number is closed and reused
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.fd = fd;
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) != 0 && errno != EEXIST) {
+		int err = errno;
+		spinUnlock(&f->lock);
+		preemptEnable();
+		return err;
+	}
+
+	// It became ready after the call failed
+	if (f->seq[dir] != seq) {
+		spinUnlock(&f->lock);
+		preemptEnable();
+		return 0;
+	}
+
+	waitQueuePush(&f->waiters[dir], self);
+	__atomic_add_fetch(&s->numParked, 1, __ATOMIC_SEQ_CST);
+
+	// Wait for the poller to requeue us
+	blockThread(s, &f->lock, BLOCK_IO);
+
+	preemptEnable();
+	return 0;
+}
+
+// Requeue the threads whose fds are ready. timeout is in milliseconds, -1 waits until something happens.
+// Call with pollLock held. Returns the number of events
+int pollIo(Schedular * s, int timeout) {
+
+	struct epoll_event events[MAX_IO_EVENTS];
+
+	int n = epoll_wait(epollFd, events, MAX_IO_EVENTS, timeout);
+
+	int i;
+	for (i = 0; i < n; i++) {
+
+		int fd = events[i].data.fd;
+
+		// Another worker woke us
+		if (fd == wakeFd) {
+			uint64_t count;
+			while (read(wakeFd, &count, sizeof(count)) > 0);
+			continue;
+		}
+
+		FdWaiters * f = &fdTable[fd];
+		spinLock(&f->lock);
+		if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) wakeFdWaiters(s, f, FD_READ);
+		if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) wakeFdWaiters(s, f, FD_WRITE);
+		spinUnlock(&f->lock);
+	}
+
+	return n;
+}
+
+// Poll without blocking if threads are parked on I/O and no other worker is polling
+void pollIoNow(Schedular * s) {
+	if (!reactorStarted || s->numParked == 0 || !spinTryLock(&pollLock)) return;
+	pollIo(s, 0);
+	spinUnlock(&pollLock);
+}
+
+// Idle worker: block in epoll_wait until an fd is ready, work is queued or timeout milliseconds pass (-1 for no limit).
+// Returns 0 if another worker is already polling
+int pollIoIdle(Schedular * s, unsigned int seq, int timeout) {
+
+	if (!reactorStarted || s->numParked == 0 || !spinTryLock(&pollLock)) return 0;
+
+	// Either a waker sees pollerBlocked and writes wakeFd, or we see its wakeSeq bump and don't block
+	__atomic_store_n(&pollerBlocked, 1, __ATOMIC_SEQ_CST);
+	pollIo(s, __atomic_load_n(&s->wakeSeq, __ATOMIC_SEQ_CST) == seq ? timeout : 0);
+	__atomic_store_n(&pollerBlocked, 0, __ATOMIC_SEQ_CST);
+
+	spinUnlock(&pollLock);
+	return 1;
+}
+
+// Get a worker blocked in epoll_wait to look for new work
+void wakePoller(void) {
+	if (__atomic_load_n(&pollerBlocked, __ATOMIC_SEQ_CST)) {
+		uint64_t one = 1;
+		write(wakeFd, &one, sizeof(one));
+	}
+}
+
+
+/************************ WRAPPERS ****************************/
+
+
+// Read from fd, parking only the calling thread until there is data
+ssize_t ult_read(int fd, void * buf, size_t count) {
+
+	FdWaiters * f = fdWaiters(fd);
+	if (f == NULL) return read(fd, buf, count);
+
+	while (1) {
+		unsigned int seq = __atomic_load_n(&f->seq[FD_READ], __ATOMIC_ACQUIRE);
+
+		ssize_t r = read(fd, buf, count);
+		if (r >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) return r;
+
+		int err = waitFd(schedular, fd, f, FD_READ, seq);
+		if (err != 0) {
+			errno = err;
+			return -1;
+		}
+	}
+}
+
+// Write to fd, parking only the calling thread until there is room
+ssize_t ult_write(int fd, const void * buf, size_t count) {
+
+	FdWaiters * f = fdWaiters(fd);
+	if (f == NULL) return write(fd, buf, count);
+
+	while (1) {
+		unsigned int seq = __atomic_load_n(&f->seq[FD_WRITE], __ATOMIC_ACQUIRE);
+
+		ssize_t r = write(fd, buf, count);
+		if (r >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) return r;
+
+		int err = waitFd(schedular, fd, f, FD_WRITE, seq);
+		if (err != 0) {
+			errno = err;
+			return -1;
+		}
+	}
+}
+
+// Accept a connection, parking only the calling thread until one arrives. The new fd is non-blocking
+int ult_accept(int fd, struct sockaddr * addr, socklen_t * addrlen) {
+
+	FdWaiters * f = fdWaiters(fd);
+	if (f == NULL) return accept(fd, addr, addrlen);
+
+	while (1) {
+		unsigned int seq = __atomic_load_n(&f->seq[FD_READ], __ATOMIC_ACQUIRE);
+
+		int r = accept4(fd, addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (r >= 0) {
+			if (r < MAX_NUM_FDS) fdTable[r].nonblocking = 1;
+			return r;
+		}
+		if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+
+		int err = waitFd(schedular, fd, f, FD_READ, seq);
+		if (err != 0) {
+			errno = err;
+			return -1;
+		}
+	}
+}
+
+// Connect a socket, parking only the calling thread until the connection is made or fails
+int ult_connect(int fd, const struct sockaddr * addr, socklen_t addrlen) {
+
+	FdWaiters * f = fdWaiters(fd);
+	if (f == NULL) return connect(fd, addr, addrlen);
+
+	unsigned int seq = __atomic_load_n(&f->seq[FD_WRITE], __ATOMIC_ACQUIRE);
+
+	if (connect(fd, addr, addrlen) == 0) return 0;
+	if (errno != EINPROGRESS) return -1;
+
+	// The socket becomes writable once the handshake is over
+	while (1) {
+		int err = waitFd(schedular, fd, f, FD_WRITE, seq);
+		if (err != 0) {
+			errno = err;
+			return -1;
+		}
+
+		seq = __atomic_load_n(&f->seq[FD_WRITE], __ATOMIC_ACQUIRE);
+
+		int result;
+		socklen_t len = sizeof(result);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &result, &len) != 0) return -1;
+		if (result == 0) {
+			// Still in progress if we were woken by an edge in the other direction
+			struct sockaddr_storage peer;
+			socklen_t peerLen = sizeof(peer);
+			if (getpeername(fd, (struct sockaddr *) &peer, &peerLen) == 0) return 0;
+			if (errno != ENOTCONN) return -1;
+			continue;
+		}
+		errno = result;
+		return -1;
+	}
+}
+
+// Close fd, waking any thread still waiting on it. Use this instead of close for fds used with the wrappers
+int ult_close(int fd) {
+
+	if (fd >= 0 && fd < MAX_NUM_FDS && reactorStarted) {
+		FdWaiters * f = &fdTable[fd];
+
+		preemptDisable();
+		spinLock(&f->lock);
+		epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, NULL);
+		f->nonblocking = 0;
+
+		// They retry and see the fd is gone
+		wakeFdWaiters(schedular, f, FD_READ);
+		wakeFdWaiters(schedular, f, FD_WRITE);
+		spinUnlock(&f->lock);
+		preemptEnable();
+	}
+
+	return close(fd);
+}
@@ -2,7 +2,32 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <sys/time.h>
+#include "ult.h"
 #include "schedular.c"
+#include "io.c"
+#include "timer.c"
+#include "trace.c"
+#include "rwlock.c"
+#include "barrier.c"
+#include "semaphore.c"
+#include "specific.c"
+#include "task.c"
+#include "chan.c"
+
+// dlfcn.h only defines RTLD_NEXT with _GNU_SOURCE, which would also turn pthread_yield into sched_yield
+#ifndef RTLD_NEXT
+#define RTLD_NEXT ((void *) -1l)
+#endif
+
+// Older headers only expose the thread id of SIGEV_THREAD_ID through the union
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
 
 // typedef unsigned long int pthread_t;
 
@@ -10,214 +35,579 @@
 int schedularCreated = 0; // Flag set to 1 if schedular has been created
 Schedular *schedular; // Schedular Object
 
-// Schedular's context stack 
+// Schedular's context stack for the first worker. Other workers use their kernel thread's own stack
 char sched_stack[16384];
 
-// Context stacks for dynamically creating new threads
-char templ_stack[1000][8192];
+// Number of workers to start with. ULT_WORKERS or ult_set_workers override it
+int numWorkersWanted = 1;
+
+// Stack size an attr reports when nobody has set one, glibc's default. Such attrs get defaultStackSize instead
+size_t attrDefaultStackSize = 0;
+
+
+// Preemption timer settings. ULT_QUANTUM_US and ULT_TIMER override the defaults at startup
+long quantum = ULT_DEFAULT_QUANTUM_US; // Microseconds, 0 turns preemption off
+int timerKind = ULT_TIMER_REAL;
+unsigned int timerGen = 0; // Bumped when the settings change so every worker remakes its timer
+int perWorkerTimers = 0; // Set once there is more than one worker. Each then has a timer signalling only itself
 
 
 // The schedular for the multi-threaded lib
-struct Schedular * makeSchedular(TCB * main_block);
+struct Schedular * makeSchedular(void);
+void schedule(void);
+void preempt(void);
 
 // The function to be called once the timer has run out.
 // For round robin premptive switching
 void handle_SIGALRM() {
-	pthread_yield();
+
+	// Inside the library the queues may be half updated. Yield once the critical section ends
+	if (currWorker == NULL || preemptCount > 0) {
+		yieldPending = 1;
+		return;
+	}
+
+	// The interrupted code may be between a failed call and reading errno
+	int savedErrno = errno;
+	preempt();
+	errno = savedErrno;
 }
 
 // The handler for the alarm
 struct sigaction handler;
 
 
-// Creates a user level thread
-int pthread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*start_routine) (void *) , void *arg) {
-	
-	alarm(0);
+// Keep the alarm handler from switching threads until the matching preemptEnable
+void preemptDisable(void) {
+	preemptCount++;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+// Make the preemption timer of worker w. Returns 0 or an errno value
+int createTimer(Worker * w) {
+
+	struct sigevent ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.sigev_signo = SIGALRM;
+	clockid_t clock = CLOCK_MONOTONIC;
+
+	if (perWorkerTimers) {
+		// A process wide timer could interrupt any worker, so each worker times itself
+		ev.sigev_notify = SIGEV_THREAD_ID;
+		ev.sigev_notify_thread_id = w->tid;
+		if (timerKind == ULT_TIMER_VIRTUAL) clock = CLOCK_THREAD_CPUTIME_ID;
+	} else {
+		ev.sigev_notify = SIGEV_SIGNAL;
+	}
+
+	if (timer_create(clock, &ev, &w->timer) != 0) return errno;
+	w->timerCreated = 1;
+	return 0;
+}
+
+// Start or stop the calling worker's periodic preemption timer
+void setTimer(int on) {
+
+	Worker * w = currentWorker();
+	long usec = on ? quantum : 0;
+
+	// Settings changed since this worker's timer was made
+	if (w->timerGen != timerGen && w->timerCreated) {
+		timer_delete(w->timer);
+		w->timerCreated = 0;
+	}
+	w->timerGen = timerGen;
+
+	if (perWorkerTimers || timerKind == ULT_TIMER_POSIX) {
+		if (!w->timerCreated && (!on || createTimer(w) != 0)) {
+			w->timerArmed = 0;
+			return;
+		}
+		struct itimerspec ts;
+		ts.it_interval.tv_sec = usec / 1000000;
+		ts.it_interval.tv_nsec = (usec % 1000000) * 1000;
+		ts.it_value = ts.it_interval;
+		timer_settime(w->timer, 0, &ts, NULL);
+	} else {
+		struct itimerval it;
+		it.it_interval.tv_sec = usec / 1000000;
+		it.it_interval.tv_usec = usec % 1000000;
+		it.it_value = it.it_interval;
+		setitimer(timerKind == ULT_TIMER_VIRTUAL ? ITIMER_VIRTUAL : ITIMER_REAL, &it, NULL);
+	}
+
+	w->timerArmed = on;
+}
+
+// Only run the timer while some thread is waiting for a worker, or for I/O or a timeout its ticks poll for.
+// This is a syscall only when that changes
+void updateTimer(void) {
+	Worker * w = currentWorker();
+	int want = quantum > 0 && (schedular->numReady > schedular->numWorkers || schedular->numParked > 0 || schedular->numTimed > 0);
+	if (want != w->timerArmed || (want && w->timerGen != timerGen)) setTimer(want);
+}
+
+// Leave a critical section, taking the yield the alarm asked for if this was the outermost one
+void preemptEnable(void) {
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	if (preemptCount == 1) updateTimer();
+	if (--preemptCount == 0 && yieldPending) {
+		yieldPending = 0;
+		preempt();
+	}
+}
+
+// The running thread used its whole quantum. It drops a priority level and gives way to any thread at least as important
+void preempt(void) {
+	preemptDisable();
+	preemptThread(schedular);
+	preemptEnable();
+}
+
+// Entry point of the kernel threads of every worker but the first
+void * workerMain(void * arg) {
+
+	Worker * w = (Worker *) arg;
+	currWorker = w;
+	w->tid = syscall(SYS_gettid);
+
+	// The schedular context always runs with preemption disabled
+	preemptCount = 1;
+
+	// This stack becomes the worker's schedular context on its first switch
+	schedule();
+	return NULL;
+}
+
+// Start workers until there are n of them
+int startWorkers(int n) {
+
+	// The real pthread_create, since this library replaces it
+	int (*createKernelThread)(pthread_t *, const pthread_attr_t *, void *(*)(void *), void *);
+	createKernelThread = dlsym(RTLD_NEXT, "pthread_create");
+	if (createKernelThread == NULL) return EAGAIN;
+
+	preemptDisable();
+
+	// Stop the process wide timer before workers get timers of their own
+	if (!perWorkerTimers && n > 1) {
+		if (currentWorker()->timerArmed) setTimer(0);
+		perWorkerTimers = 1;
+		timerGen++;
+	}
+
+	while (schedular->numWorkers < n) {
+
+		Worker * w = (Worker *) aligned_alloc(64, sizeof(Worker));
+		memset(w, 0, sizeof(Worker));
+		w->id = schedular->numWorkers;
+
+		pthread_t kernelThread;
+		if (createKernelThread(&kernelThread, NULL, workerMain, w) != 0) {
+			free(w);
+			preemptEnable();
+			return EAGAIN;
+		}
+
+		// Publish it only once it is running, thieves skip empty slots
+		__atomic_store_n(&schedular->workers[w->id], w, __ATOMIC_RELEASE);
+		__atomic_add_fetch(&schedular->numWorkers, 1, __ATOMIC_SEQ_CST);
+	}
+
+	preemptEnable();
+	return 0;
+}
+
+// Build the schedular around the calling thread and start preemption
+void initSchedular(void) {
+
+	schedular = makeSchedular();
+	schedularCreated = 1;
+
+	if(currentWorker()->current == NULL) printf("sched head null\n");
+
+	// Initialize the timer with the handler
+	handler.sa_handler = handle_SIGALRM;
+	handler.sa_flags = SA_NODEFER; // The handler switches threads, so SIGALRM must not stay blocked
+	sigaction(SIGALRM,&handler, NULL);
+	sigaction(SIGVTALRM,&handler, NULL);
+
+	// Timer settings from the environment
+	char * env = getenv("ULT_QUANTUM_US");
+	if (env != NULL) quantum = atol(env);
+
+	env = getenv("ULT_TIMER");
+	if (env != NULL && strcmp(env, "virtual") == 0) timerKind = ULT_TIMER_VIRTUAL;
+	if (env != NULL && strcmp(env, "posix") == 0) timerKind = ULT_TIMER_POSIX;
+
+	env = getenv("ULT_MUTEX_POLICY");
+	if (env != NULL && strcmp(env, "barging") == 0) schedular->mutexPolicy = ULT_MUTEX_BARGING;
+
+	// What an attr without a size of its own says
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_getstacksize(&attr, &attrDefaultStackSize);
+	pthread_attr_destroy(&attr);
+
+	env = getenv("ULT_STACK_RESERVE");
+	if (env != NULL) ult_set_stack_reserve(strtoul(env, NULL, 0));
+
+	env = getenv("ULT_STACK_TRIM_MS");
+	if (env != NULL) ult_set_stack_trim(atol(env));
+
+	env = getenv("ULT_WORKERS");
+	if (env != NULL && atoi(env) > 0) numWorkersWanted = atoi(env);
+	if (numWorkersWanted > MAX_NUM_WORKERS) numWorkersWanted = MAX_NUM_WORKERS;
+
+	startWorkers(numWorkersWanted);
+
+	// ULT_TRACE_FILE dumps the trace at exit
+	startTrace();
+
+	ult_set_quantum(quantum, timerKind);
+}
+
+// Set the preemption quantum and the clock that drives it
+int ult_set_quantum(long usec, int timer) {
+
+	if (usec < 0 || timer < ULT_TIMER_REAL || timer > ULT_TIMER_POSIX) return EINVAL;
+
+	if (schedularCreated == 0) initSchedular();
+
+	preemptDisable();
+
+	// Stop the old timer before switching clocks
+	if (currentWorker()->timerArmed) setTimer(0);
+
+	quantum = usec;
+	timerKind = timer;
+	timerGen++;
+
+	// Make the calling worker's timer now so a failure can be reported. The others make theirs when they next need it
+	if (usec > 0 && (perWorkerTimers || timer == ULT_TIMER_POSIX)) {
+		Worker * w = currentWorker();
+		if (w->timerCreated) {
+			timer_delete(w->timer);
+			w->timerCreated = 0;
+		}
+		w->timerGen = timerGen;
+		int err = createTimer(w);
+		if (err != 0) {
+			preemptEnable();
+			return err;
+		}
+	}
+
+	// Leaving the critical section arms the new timer if there is anything to preempt
+	preemptEnable();
+	return 0;
+}
+
+// Run green threads on n kernel threads. Workers can be added but not taken away
+int ult_set_workers(int n) {
+
+	if (n < 1 || n > MAX_NUM_WORKERS) return EINVAL;
 
-	//printf("create\n");
-	// Check flag to see if the schedular has been created. If not, create it.
 	if (schedularCreated == 0) {
+		numWorkersWanted = n;
+		initSchedular();
+		return 0;
+	}
+
+	if (n < schedular->numWorkers) return EINVAL;
+	return startWorkers(n);
+}
+
+
+// Choose between handing a contended mutex to its first waiter and letting threads barge in
+int ult_set_mutex_policy(int policy) {
+
+	if (policy != ULT_MUTEX_HANDOFF && policy != ULT_MUTEX_BARGING) return EINVAL;
+
+	if (schedularCreated == 0) initSchedular();
+
+	schedular->mutexPolicy = policy;
+	return 0;
+}
+
+
+// Exit the calling thread with value for its joiner
+__attribute__((noreturn)) void finishThread(void * value) {
+
+	// Destructors are user code, so they run before the critical section
+	runKeyDestructors();
+	preemptDisable();
+
+	threadSlot(schedular, currentWorker()->current->thread_cb->thread_id)->exitVal = value;
+
+	// swap to schedular context to perform exit. Nothing switches back
+	exitThread(schedular);
+	__builtin_unreachable();
+}
+
+// Set the stack reserved for threads created without a stack size of their own. Only the pages they touch are committed
+int ult_set_stack_reserve(size_t bytes) {
+
+	if (bytes < PTHREAD_STACK_MIN) return EINVAL;
+
+	defaultStackSize = bytes;
+	return 0;
+}
+
+// Trim the stacks of threads blocked for ms milliseconds, or never if ms is 0
+int ult_set_stack_trim(long ms) {
+
+	if (ms < 0) return EINVAL;
+
+	stackTrimMs = ms;
+	return 0;
+}
+
 
-		// Create TCB for main
-		TCB * main_block =  (TCB *) malloc(sizeof(TCB));
+// Entry point of every created thread
+void threadStart(void) {
 
-		schedular = makeSchedular(main_block);
-		schedularCreated = 1;
+	// Finish the switch that brought us here. New threads start with preemption disabled
+	afterSwitch(schedular);
 
-		if(schedular->head == NULL) printf("sched head null\n");
+	TCB * self = currentWorker()->current->thread_cb;
+	preemptEnable();
+
+	// Returning from the start routine exits the thread
+	finishThread(self->start_routine(self->arg));
+}
+
+
+// Creates a user level thread
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*start_routine) (void *) , void *arg) {
 
-		// Initialize the timer with the handler
-		handler.sa_handler = handle_SIGALRM;
-		sigaction(SIGALRM,&handler, NULL);
+	//printf("create\n");
+	// Check flag to see if the schedular has been created. If not, create it.
+	if (schedularCreated == 0) initSchedular();
+
+	preemptDisable();
+
+
+	// Stack size and guard come from attr when given, otherwise the pool defaults. An attr reports glibc's
+	// default whether or not it was set to it, so a size equal to that default is taken as never set
+	size_t stackSize = defaultStackSize;
+	size_t guardSize = pageRound(1);
+	int detachState = PTHREAD_CREATE_JOINABLE;
+	if (attr != NULL) {
+		size_t attrSize;
+		pthread_attr_getstacksize(attr, &attrSize);
+		if (attrSize != attrDefaultStackSize) stackSize = attrSize;
+		pthread_attr_getguardsize(attr, &guardSize);
+		pthread_attr_getdetachstate(attr, &detachState);
 	}
 
+	// Thread's context stack 
+	Stack * stack = allocStack(stackSize, guardSize);
+	if (stack == NULL) {
+		preemptEnable();
+		return EAGAIN;
+	}
 
 	//printf("tcb creating\n");
 
-	// Dynamically create a new thread
-	TCB * new_thread =  (TCB *) malloc(sizeof(TCB));
+	// Dynamically create a new thread. The TCB and its queue node come from the slab together
+	ThreadBlock * new_block = (ThreadBlock *) slabAlloc(&schedular->threadSlab);
+	if (new_block == NULL) {
+		freeStack(stack);
+		preemptEnable();
+		return EAGAIN;
+	}
+	TCB * new_thread = &new_block->tcb;
+	new_thread->stack = stack;
+	new_thread->preemptCount = 1;
+
+	// Scheduling comes from attr only with PTHREAD_EXPLICIT_SCHED, otherwise it is inherited from the creating thread
+	TCB * creator = currentWorker()->current->thread_cb;
+	int policy = creator->schedPolicy;
+	struct sched_param param;
+	param.sched_priority = creator->schedPriority;
+	int inherit = PTHREAD_INHERIT_SCHED;
+	if (attr != NULL) pthread_attr_getinheritsched(attr, &inherit);
+	if (inherit == PTHREAD_EXPLICIT_SCHED) {
+		pthread_attr_getschedpolicy(attr, &policy);
+		pthread_attr_getschedparam(attr, &param);
+	}
+	setSchedParams(schedular, new_thread, policy, param.sched_priority);
 	//printf("tcb crated\n");
 
-	// Thread's context stack 
-	//printf("test\n");
 	// Initialize this new context
 	//printf("context retrieving\n");
-	getcontext(&new_thread->thread_context);
-	//printf("context retrieved\n");
-	(new_thread->thread_context).uc_link          = &schedular->sched_context;
-    (new_thread->thread_context).uc_stack.ss_sp   = templ_stack[schedular->numCreated + 1];
-    (new_thread->thread_context).uc_stack.ss_size = 8192;
+	new_thread->start_routine = start_routine;
+	new_thread->arg = arg;
 
     // Create the context for the new thread
-	makecontext(&new_thread->thread_context, start_routine, 1, arg);
+	makeContext(&new_thread->thread_context, stackBottom(stack), stack->size, threadStart);
 	//printf("context made\n");
 	// Add this to the ready queue
-	addThread(thread, schedular, new_thread);
-	alarm(1);
-	return 0;
+	int err = addThread(thread, schedular, new_block, 0, detachState == PTHREAD_CREATE_DETACHED);
+	if (err != 0) {
+		freeStack(stack);
+		slabFree(&schedular->threadSlab, new_block);
+	}
+	preemptEnable();
+	return err;
 
 }
 
 
 // Terminate the calling thread. Return value set that can be used by the calling thread when calling pthread_join
 void pthread_exit(void *value_ptr) { 
-	alarm(0);
-	// Set schedularAction flag to 0 
-	schedular->action = 0;
-
-	// Set the exit val
-	joinVals[schedular->head->thread_cb->thread_id] = *((int*)value_ptr);
-
-	// swap to schedular context to perform exit
-	swapcontext(&schedular->head->thread_cb->thread_context, &schedular->sched_context);
-	alarm(1);
+	finishThread(value_ptr);
 }
 
 // Calling thread gives up the CPU
 int pthread_yield(void) {
-	alarm(0);
-	// Set schedular action flag to 1 	
-	schedular->action = 1;
+	preemptDisable();
 
-	// swap to schedular context to perform yield
-	swapcontext(&schedular->head->thread_cb->thread_context, &schedular->sched_context);
+	// Move to the back of the ready queue and switch straight to the next thread
+	runNextThread(schedular);
 
 	//printf("eihjkjewr\n");
-	alarm(1);
+	preemptEnable();
 	return 0;
 }
 
 
 // Finish execution of the target thread before finishing execution of the calling thread
 int pthread_join(pthread_t thread, void **value_ptr) {
-	alarm(0);
+	preemptDisable();
 	//printf("join on thread %d\n",thread);
 	//printf("j1\n");
-	// Set schedular action flag to 2 
-	schedular->action = 2;
-
-	// Set schedular joining flag
-	schedular->join_id = thread;
-
-	//printf("j2\n");
 
-	// swap to schedular context to perform join
-	swapcontext(&schedular->head->thread_cb->thread_context, &schedular->sched_context);
+	// Wait on the target's join list until it exits
+	void * value;
+	int err = join(schedular, thread, &value);
 
 	//printf("j3\n");
 
 	// Set the join val
-	if(value_ptr != NULL) *value_ptr = &joinVals[thread];
+	if(err == 0 && value_ptr != NULL) *value_ptr = value;
 
 	//printf("j4\n");
-	alarm(1);
-	return 0;
+	preemptEnable();
+	return err;
 }
 
-// Schecule the next task on the queue 
-void schedule(void) {
+// Let the thread's resources go as soon as it exits, without a join. Returns 0, ESRCH or EINVAL
+int pthread_detach(pthread_t thread) {
+	if (schedularCreated == 0) initSchedular();
 
-	// While the schedular has threads that need executing
-	while (!isEmpty(schedular)) { 
+	preemptDisable();
+	int err = detach(schedular, thread);
+	preemptEnable();
+	return err;
+}
 
+// Id of the calling thread
+pthread_t pthread_self(void) {
+	if (schedularCreated == 0) initSchedular();
+	return currentWorker()->current->thread_cb->thread_id;
+}
 
-		if (schedular->action == 0) {
+// Set a thread's scheduling policy and priority. They pick its priority level: SCHED_FIFO and SCHED_RR
+// threads start at the top, SCHED_BATCH and SCHED_IDLE ones at the bottom
+int pthread_setschedparam(pthread_t thread, int policy, const struct sched_param *param) {
 
-			// exit the current running thread
-			currExit(schedular);
+	if (policy != SCHED_OTHER && policy != SCHED_FIFO && policy != SCHED_RR && policy != SCHED_BATCH && policy != SCHED_IDLE) return EINVAL;
+	if (param->sched_priority < sched_get_priority_min(policy) || param->sched_priority > sched_get_priority_max(policy)) return EINVAL;
 
-		} else if (schedular->action == 1) {
+	if (schedularCreated == 0) initSchedular();
 
-			// yield
-			runNextThread(schedular);
+	preemptDisable();
+	int err = setThreadSched(schedular, thread, policy, param->sched_priority);
+	preemptEnable();
+	return err;
+}
 
-		} else if (schedular->action == 2) {
+// Get a thread's scheduling policy and priority
+int pthread_getschedparam(pthread_t thread, int *policy, struct sched_param *param) {
 
-			// Join to another thread
-			join(schedular);
+	if (schedularCreated == 0) initSchedular();
 
-		} else if (schedular->action == 3) {
-			// Add the current thread to the queue of the specified cond. variable
-			waitOnCond(schedular);
+	preemptDisable();
+	int err = getThreadSched(schedular, thread, policy, &param->sched_priority);
+	preemptEnable();
+	return err;
+}
 
-		} else if (schedular->action == 4) {
-			// Take one thread off the waiting queue and add it to the ready queue
-			sig(schedular);
-		} else if (schedular->action == 5) {
+// A worker's idle loop. Exiting threads and threads with nothing to switch to come here,
+// everything else switches thread to thread
+void schedule(void) {
 
-			// Add all threads waiting on a specific cond. variable to the back of the queue
-			broadcast(schedular);
-		}else if (schedular->action == 6) {
-			// Take one thread off the mutex waiting queue and add it to the ready queue
-			unlock(schedular);
-		} else if (schedular->action == 7) {
-			// Add all threads waiting on a specific mutex to the back of the queue
-			lock(schedular);
-		}
-	
-	} 
+	Worker * w = currentWorker();
 
+	// While the schedular has threads that need executing
+	while (1) { 
+
+		// Finish the switch that brought us here
+		afterSwitch(schedular);
 
-	//printf("done\n");
+		// exit the thread that just switched here
+		if (w->exited != NULL) {
+			Node * temp = w->exited;
+			w->exited = NULL;
+			currExit(schedular, temp);
+		}
 
+		// Resume the next runnable thread, sleeping until there is one
+		Node * next = waitForWork(schedular, w);
+		noteSwitch(w, NULL, next);
+		w->current = next;
+		if (next->thread_cb->trimState != TRIM_NONE) claimStack(next->thread_cb);
+		switchContext(&w->sched_context, &next->thread_cb->thread_context);
+	} 
 }
 
 
 // Create a new schedular
-struct Schedular * makeSchedular(TCB * main_block) {
+struct Schedular * makeSchedular(void) {
 
 	// Allocate memory for Schedular
 	Schedular * s = (Schedular *) malloc(sizeof(Schedular));
+	memset(s, 0, sizeof(Schedular));
 
 	// Initialize the variables
 	s->size = 0;
-	s->maxSize = MAX_NUM_NODES;
+	s->maxSize = MAX_IDS - 1;
 	s->numCreated = 0;
-	s->head = NULL;
-	s->tail = NULL;
-	s->action = -1;
-	s->nextCondId = 0;
-	s->nextMutexId = 0;
-
-	// Initialise the schedular context. uc_link points to main_context
-	getcontext(&s->sched_context);
-    (s->sched_context).uc_link          = 0; // Schedular doesn't link back to any particular thread
-    (s->sched_context).uc_stack.ss_sp   = sched_stack;
-    (s->sched_context).uc_stack.ss_size = sizeof(sched_stack);
- 
- 	// Create the context for the schedular
-	makecontext(&s->sched_context, schedule, 0);
-
-	// dummy pthread_t for the main
+	makeIdTables(s);
+	idTableInit(&rwlockTable, sizeof(RwLockObject), 1);
+	idTableInit(&barrierTable, sizeof(BarrierObject), 1);
+	idTableInit(&semTable, sizeof(SyncObject), 1);
+	idTableInit(&keyTable, sizeof(KeyObject), 0);
+	makeTaskPool();
+	s->mutexPolicy = ULT_MUTEX_HANDOFF;
+	s->numReady = 0;
+	slabInit(&s->threadSlab, sizeof(ThreadBlock));
+
+	// The calling kernel thread is the first worker
+	Worker * w = (Worker *) aligned_alloc(64, sizeof(Worker));
+	memset(w, 0, sizeof(Worker));
+	w->id = 0;
+	w->tid = syscall(SYS_gettid);
+	s->workers[0] = w;
+	s->numWorkers = 1;
+	currWorker = w;
+
+	// Create the context for the schedular
+	makeContext(&w->sched_context, sched_stack, sizeof(sched_stack), schedule);
+
+	// Create TCB for main
+	ThreadBlock * main_block = (ThreadBlock *) slabAlloc(&s->threadSlab);
+	main_block->tcb.stack = NULL;
+	main_block->tcb.preemptCount = 0;
+	setSchedParams(s, &main_block->tcb, SCHED_OTHER, 0);
+
+	// dummy pthread_t for the main. Its context is saved the first time it switches out
 	pthread_t thread;
 
-	// Seth the link back to schedular when the main terminates
-	getcontext(&main_block->thread_context);
-	(main_block->thread_context).uc_link = &s->sched_context;
-
-	// Add the main context to the head of the run queue list == it is running
-	addThread(&thread, s, main_block);
+	// main is already running on the first worker
+	addThread(&thread, s, main_block, 1, 0);
 
 	// Return the initialized queue
 	return s;
@@ -232,70 +622,120 @@ struct Schedular * makeSchedular(TCB * main_block) {
 //// Mutex //////
 
 
-// Initialize the mutex
-int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr) {
+// The id of the mutex's queue in the mutex table. A mutex set up by PTHREAD_MUTEX_INITIALIZER has id 0
+// and gets its id the first time a thread has to wait on it
+int mutexId(pthread_mutex_t *mutex) {
 
-	// count as index
-	// lock is either 0(free) or 1(locked)
+	int id = __atomic_load_n(&mutex->__data.__owner, __ATOMIC_ACQUIRE);
+	if (id != 0) return id;
 
-	// Check if the schedular has been built. If not build it
-	if (schedularCreated == 0) {
+	if (schedularCreated == 0) initSchedular();
 
-		// Create TCB for main
-		TCB * main_block =  (TCB *) malloc(sizeof(TCB));
+	int fresh = idAlloc(&mutexTable);
+	if (fresh == -1) {
+		perror("mutex table");
+		exit(1);
+	}
 
-		schedular = makeSchedular(main_block);
-		schedularCreated = 1;
+	// Another thread may have given it one first
+	if (__atomic_compare_exchange_n(&mutex->__data.__owner, &id, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return fresh;
+	idFree(&mutexTable, fresh);
+	return id;
+}
 
-		// Initialize the timer with the handler
-		handler.sa_handler = handle_SIGALRM;
-		sigaction(SIGALRM,&handler, NULL);
-	}
+// Initialize the mutex
+int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr) {
 
-	// Check if you can create another mutex
-	if (schedular->nextMutexId == MAX_NUM_MUTEX_VARS) return -1;
+	// owner as the id of its queue in the mutex table
+	// lock is MUTEX_FREE, MUTEX_LOCKED or MUTEX_CONTENDED
 
-	// Create the queue for this cond. var
+	// Check if the schedular has been built. If not build it
+	if (schedularCreated == 0) initSchedular();
 
-	// Set the index(count) for the mutex. for where it is in the queue array
-	mutex->__data.__owner = schedular->nextMutexId++;
+	// Take an id, reusing one of a destroyed mutex if there is one
+	int id = idAlloc(&mutexTable);
+	if (id == -1) return ENOMEM;
+
+	// Set the index(id) for the mutex. for where it is in the mutex table
+	mutex->__data.__owner = id;
 	//printf("xx: %d\n",mutex->__data.__owner);
-	mutex->__data.__lock = 0;
+	mutex->__data.__lock = MUTEX_FREE;
 	return 0;
 
 }
 
-// Destroy the mutex
+// Destroy the mutex, giving its id back. Returns EBUSY if it is locked
 int pthread_mutex_destroy(pthread_mutex_t *mutex) {
-	
-	free(mutex);
+
+	int id = mutex->__data.__owner;
+	if (id == 0) return mutex->__data.__lock != MUTEX_FREE ? EBUSY : 0;
+
+	preemptDisable();
+	SyncObject * m = mutexObject(id);
+	spinLock(&m->lock);
+	if (mutex->__data.__lock != MUTEX_FREE || m->queue.head != NULL) {
+		spinUnlock(&m->lock);
+		preemptEnable();
+		return EBUSY;
+	}
+	spinUnlock(&m->lock);
+
+	mutex->__data.__owner = 0;
+	idFree(&mutexTable, id);
+	preemptEnable();
 	return 0;
 
 }
 
 // Lock the mutex
 int pthread_mutex_lock(pthread_mutex_t *mutex) {
-	alarm(0);
-	if(mutex->__data.__lock == 1) {
-		schedular->action = 7;
-		schedular->currMutexVarId = mutex->__data.__owner;
-		swapcontext(&schedular->head->thread_cb->thread_context, &schedular->sched_context);
-	}
-	mutex->__data.__lock = 1;
-	alarm(1);
+
+	// Uncontended. A single atomic instruction, so preemption can stay on
+	int expected = MUTEX_FREE;
+	if (__atomic_compare_exchange_n(&mutex->__data.__lock, &expected, MUTEX_LOCKED, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return 0;
+
+	preemptDisable();
+	// Wait on the mutex queue while another thread holds it
+	lock(schedular, mutexId(mutex), &mutex->__data.__lock, -1);
+	preemptEnable();
 	return 0;
 
 }
 
+// Lock the mutex, giving up with ETIMEDOUT once the CLOCK_REALTIME time abstime has passed
+int pthread_mutex_timedlock(pthread_mutex_t *mutex, const struct timespec *abstime) {
+
+	int expected = MUTEX_FREE;
+	if (__atomic_compare_exchange_n(&mutex->__data.__lock, &expected, MUTEX_LOCKED, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return 0;
+
+	if (abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000L) return EINVAL;
+
+	preemptDisable();
+	// Wait on the mutex queue and on the timing wheel
+	int err = lock(schedular, mutexId(mutex), &mutex->__data.__lock, realtimeDeadline(abstime));
+	preemptEnable();
+	return err;
+
+}
+
+// Take the mutex only if it is free
+int pthread_mutex_trylock(pthread_mutex_t *mutex) {
+	int expected = MUTEX_FREE;
+	if (__atomic_compare_exchange_n(&mutex->__data.__lock, &expected, MUTEX_LOCKED, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return 0;
+	return EBUSY;
+}
+
 // Unlock the mutex
 int pthread_mutex_unlock(pthread_mutex_t *mutex) {
-	alarm(0);
-	schedular->action = 6;
+
+	// Nobody is waiting
+	int expected = MUTEX_LOCKED;
+	if (__atomic_compare_exchange_n(&mutex->__data.__lock, &expected, MUTEX_FREE, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) return 0;
+
+	preemptDisable();
 	//printf("x: %d\n",mutex->__data.__owner);
-	schedular->currMutexVarId = mutex->__data.__owner;
-	swapcontext(&schedular->head->thread_cb->thread_context, &schedular->sched_context);
-	mutex->__data.__lock = 0;
-	alarm(1);
+	unlock(schedular, mutexId(mutex), &mutex->__data.__lock);
+	preemptEnable();
 	return 0;
 
 }
@@ -304,99 +744,135 @@ int pthread_mutex_unlock(pthread_mutex_t *mutex) {
 /////////// Conditional Vars /////////////
 
 
-// Initialize the conditional variable
-int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr) {
-
-	// Check if the schedular has been built. If not build it
-	if (schedularCreated == 0) {
+// The id of the cond. var's queue in the cond. var table. A cond. var set up by PTHREAD_COND_INITIALIZER
+// has id 0 and gets its id the first time it is used
+int condId(pthread_cond_t *cond) {
 
-		// Create TCB for main
-		TCB * main_block =  (TCB *) malloc(sizeof(TCB));
+	long long id = __atomic_load_n(&cond->__align, __ATOMIC_ACQUIRE);
+	if (id != 0) return (int) id;
 
-		schedular = makeSchedular(main_block);
-		schedularCreated = 1;
+	if (schedularCreated == 0) initSchedular();
 
-		// Initialize the timer with the handler
-		handler.sa_handler = handle_SIGALRM;
-		sigaction(SIGALRM,&handler, NULL);
+	int fresh = idAlloc(&condTable);
+	if (fresh == -1) {
+		perror("cond. var table");
+		exit(1);
 	}
 
-	// Check if you can create another conditional variable
-	if (schedular->nextCondId == MAX_NUM_COND_VARS) return -1;
+	// Another thread may have given it one first
+	if (__atomic_compare_exchange_n(&cond->__align, &id, (long long) fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return fresh;
+	idFree(&condTable, fresh);
+	return (int) id;
+}
+
+// Initialize the conditional variable
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr) {
+
+	// Check if the schedular has been built. If not build it
+	if (schedularCreated == 0) initSchedular();
 
+	// Take an id, reusing one of a destroyed cond. var if there is one
+	int id = idAlloc(&condTable);
+	if (id == -1) return ENOMEM;
 
-	// Set the index(lock) for the cond. var. for where it is in the queue array
-	cond->__data.__lock = schedular->nextCondId++;
+
+	// Set the index(id) for the cond. var. for where it is in the cond. var table
+	cond->__align = id;
 
 	return 0;
 }
 
-// Destroy the conditional variable
+// Destroy the conditional variable, giving its id back. Returns EBUSY while threads wait on it
 int pthread_cond_destroy(pthread_cond_t *cond) {
 
-	// Delete the memory allocated for the conditional variable 
-	free(cond);
+	int id = (int) cond->__align;
+	if (id == 0) return 0;
+
+	preemptDisable();
+	SyncObject * c = condObject(id);
+	spinLock(&c->lock);
+	if (c->queue.head != NULL) {
+		spinUnlock(&c->lock);
+		preemptEnable();
+		return EBUSY;
+	}
+	spinUnlock(&c->lock);
 
+	cond->__align = 0;
+	idFree(&condTable, id);
+	preemptEnable();
 	return 0;
 }
 
 
+// Hold the mutex again after a cond. var wait. A signal moves the waiter onto the mutex's queue, so with
+// handoff it usually owns the mutex already when it wakes. Call with preemption disabled
+void mutexHandedBack(pthread_mutex_t *mutex) {
+
+	Node * self = currentWorker()->current;
+	if (self->handedOff) {
+		self->handedOff = 0;
+		return;
+	}
+
+	// Not the fast path. Threads may still be on the queue with us, and taking it as just locked would strand them
+	lock(schedular, mutexId(mutex), &mutex->__data.__lock, -1);
+}
+
 // Wait until another thread wakes up this one
 int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
-	alarm(0);
-	// Give up the mutex lock
-	pthread_mutex_unlock(mutex);
+	preemptDisable();
 	//printf("cw1\n");
 
-	// Set the schedular cond. var index(lock) to the correct value
-	schedular->currCondVarId = cond->__data.__lock;
-
-	// Set the correct action for the schedular
-	schedular->action = 3;
-
 	//printf("cw2\n");
 
-	// Add the current running thread to the queue of the cond. var(context switch)
-	swapcontext(&schedular->head->thread_cb->thread_context, &schedular->sched_context);
+	// Add the current running thread to the queue of the cond. var(context switch).
+	// The mutex is given up once we are on the queue so a signal in between isn't lost
+	waitOnCond(schedular, condId(cond), mutexId(mutex), &mutex->__data.__lock, -1);
 
 	//printf("cw3\n");
 
-	// Reaquire the mutex 
-	pthread_mutex_lock(mutex);
+	// Reaquire the mutex, unless the unlock that woke us handed it over
+	mutexHandedBack(mutex);
 
 	//printf("cw4\n");
-	alarm(1);
+	preemptEnable();
 	return 0;
 }
 
-// Wake up the next thread waiting on the conditional variable 
-int pthread_cond_signal(pthread_cond_t *cond) {
-	alarm(0);
-	// Set the schedular cond. var index to the correct value
-	schedular->currCondVarId = cond->__data.__lock;
+// Wait until another thread wakes up this one or the CLOCK_REALTIME time abstime has passed. Returns 0 or ETIMEDOUT
+int pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *abstime) {
+
+	if (abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000L) return EINVAL;
+
+	preemptDisable();
+
+	// Same as pthread_cond_wait, with the thread on the timing wheel too
+	int err = waitOnCond(schedular, condId(cond), mutexId(mutex), &mutex->__data.__lock, realtimeDeadline(abstime));
 
-	// Set the correct action for the schedular 
-	schedular->action = 4;
+	// The mutex is held again whichever way we woke
+	mutexHandedBack(mutex);
 
-	// Take off the first thread from the queue of the cond. var and add to the ready queue(context switch)
-	swapcontext(&schedular->head->thread_cb->thread_context, &schedular->sched_context);
+	preemptEnable();
+	return err;
+}
+
+// Wake up the next thread waiting on the conditional variable 
+int pthread_cond_signal(pthread_cond_t *cond) {
+	preemptDisable();
+	// Take off the first thread from the queue of the cond. var and add to the ready queue
+	sig(schedular, condId(cond));
 
-	alarm(1);
+	preemptEnable();
 	return 0;
 }
 
 
 // Wake up all threads waiting on the conditional variable 
 int pthread_cond_broadcast(pthread_cond_t *cond) {
-	alarm(0);
-	// Set the schedular cond. var index to the correct value
-	schedular->currCondVarId = cond->__data.__lock;
-
-	// Set the correct action for the schedular 
-	schedular->action = 5;
-
-	// Take off the each thread from the queue of the cond. var and add to the ready queue(context switch)
-	swapcontext(&schedular->head->thread_cb->thread_context, &schedular->sched_context);
-	alarm(1);
+	preemptDisable();
+	// Take off the each thread from the queue of the cond. var and add to the ready queue
+	broadcast(schedular, condId(cond));
+	preemptEnable();
 	return 0;
 }
\ No newline at end of file
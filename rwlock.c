@@ -0,0 +1,304 @@
+/**
+ * rwlock.c
+ *
+ * This file contains pthread_rwlock_t
+ *
+ * The lock is one word in the pthread object: the number of readers holding
+ * it, a bit for a writer holding it and a bit saying threads may be queued.
+ * While nobody is queued, taking and dropping it is a single CAS with no
+ * schedular call. Once a thread has to wait, every change goes through the
+ * lock's entry in the rwlock table, which holds separate reader and writer
+ * queues, and a thread that is woken already holds the lock.
+ *
+ * Locks are reader-preferred unless made with
+ * PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP (pthread_rwlockattr_setkind_np
+ * or PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP). Then readers wait
+ * while a writer does, so a thread must not take the read lock twice.
+ * PTHREAD_RWLOCK_PREFER_WRITER_NP is reader-preferred, as in glibc.
+ */
+
+// Lock word bits
+#define RW_WRITER 0x80000000u // A writer holds it
+#define RW_CONTENDED 0x40000000u // Threads may be on its queues. Readers and writers take the slow path
+#define RW_READERS 0x3fffffffu // Readers holding it
+
+// Declared by pthread.h only with _GNU_SOURCE
+int pthread_rwlockattr_getkind_np(const pthread_rwlockattr_t * attr, int * pref);
+
+
+// Entry of the rwlock table. The id is kept in the pthread object
+typedef struct RwLockObject {
+	int nextFree; // Link on the table's free list
+	SpinLock lock; // Guards the queues and, while RW_CONTENDED is set, the lock word
+	WaitQueue readers;
+	WaitQueue writers;
+} RwLockObject;
+
+// Table(map) of the rwlock queues. Id 0 is an rwlock that hasn't been given its queues yet
+IdTable rwlockTable;
+
+
+// The queues of an rwlock id
+RwLockObject * rwlockObject(int id) {
+	return (RwLockObject *) idEntry(&rwlockTable, id);
+}
+
+// Does anyone wait on o. Call with its lock held
+int rwWaiting(RwLockObject * o) {
+	return o->readers.head != NULL || o->writers.head != NULL;
+}
+
+// Wait for a read lock. The caller has failed to take it without waiting. Gives up at the monotonic deadline
+// in milliseconds, or never if it is -1. Returns 0 or ETIMEDOUT
+int rdLock(Schedular * s, int id, unsigned int * word, int preferWriter, long deadline) {
+
+	RwLockObject * o = rwlockObject(id);
+	spinLock(&o->lock);
+
+	unsigned int w = __atomic_load_n(word, __ATOMIC_RELAXED);
+	while (1) {
+
+		// Free of writers, and none waiting to go first
+		if ((w & RW_WRITER) == 0 && (!preferWriter || o->writers.head == NULL)) {
+			if (__atomic_compare_exchange_n(word, &w, w + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				spinUnlock(&o->lock);
+				return 0;
+			}
+			continue;
+		}
+
+		// Marking it contended first means the holder's unlock will look at the queues
+		if (__atomic_compare_exchange_n(word, &w, w | RW_CONTENDED, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+	}
+
+	// The unlocking thread counts us in before it wakes us
+	return parkThread(s, &o->readers, &o->lock, deadline, BLOCK_MUTEX);
+}
+
+// Wait for the write lock. The caller has failed to take it without waiting. Gives up at the monotonic deadline
+// in milliseconds, or never if it is -1. Returns 0 or ETIMEDOUT
+int wrLock(Schedular * s, int id, unsigned int * word, long deadline) {
+
+	RwLockObject * o = rwlockObject(id);
+	spinLock(&o->lock);
+
+	unsigned int w = __atomic_load_n(word, __ATOMIC_RELAXED);
+	while (1) {
+
+		// Free. It stays marked contended while others wait
+		if ((w & ~RW_CONTENDED) == 0) {
+			unsigned int next = RW_WRITER | (rwWaiting(o) ? RW_CONTENDED : 0);
+			if (__atomic_compare_exchange_n(word, &w, next, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				spinUnlock(&o->lock);
+				return 0;
+			}
+			continue;
+		}
+
+		if (__atomic_compare_exchange_n(word, &w, w | RW_CONTENDED, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+	}
+
+	// The unlocking thread makes us the writer before it wakes us
+	return parkThread(s, &o->writers, &o->lock, deadline, BLOCK_MUTEX);
+}
+
+// Drop a read or write lock that is marked contended and pass it on to the threads waiting for it
+void rwUnlock(Schedular * s, int id, unsigned int * word, int preferWriter) {
+
+	RwLockObject * o = rwlockObject(id);
+	spinLock(&o->lock);
+
+	// The mark may have been cleared since the caller looked, so readers can still come and go without the lock
+	unsigned int w = __atomic_load_n(word, __ATOMIC_RELAXED);
+	unsigned int left;
+	do {
+		left = (w & RW_WRITER) ? w & ~RW_WRITER : w - 1;
+	} while (!__atomic_compare_exchange_n(word, &w, left, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	// Other readers still hold it, or nobody waits
+	if ((left & RW_READERS) != 0 || (left & RW_CONTENDED) == 0) {
+		spinUnlock(&o->lock);
+		return;
+	}
+
+	// Nothing changes the word now but us. Hand it to all the waiting readers or to the first writer
+	unsigned int next = 0;
+	if (o->readers.head != NULL && (!preferWriter || o->writers.head == NULL)) {
+		Node * n;
+		while ((n = takeWaiter(&o->readers)) != NULL) {
+			next++;
+			readyThread(s, n);
+		}
+	}
+	if (next == 0) {
+		Node * n = takeWaiter(&o->writers);
+		if (n != NULL) {
+			next = RW_WRITER;
+			readyThread(s, n);
+		}
+	}
+
+	if (rwWaiting(o)) next |= RW_CONTENDED;
+	__atomic_store_n(word, next, __ATOMIC_RELEASE);
+
+	spinUnlock(&o->lock);
+}
+
+
+/************************ READ-WRITE LOCKS ****************************/
+
+
+// Is the rwlock writer-preferred
+int rwPreferWriter(pthread_rwlock_t * rwlock) {
+	return rwlock->__data.__flags == PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP;
+}
+
+// The id of the rwlock's queues in the rwlock table. A lock set up by PTHREAD_RWLOCK_INITIALIZER has id 0
+// and gets its id the first time a thread has to wait on it
+int rwlockId(pthread_rwlock_t * rwlock) {
+
+	int id = __atomic_load_n(&rwlock->__data.__cur_writer, __ATOMIC_ACQUIRE);
+	if (id != 0) return id;
+
+	if (schedularCreated == 0) initSchedular();
+
+	int fresh = idAlloc(&rwlockTable);
+	if (fresh == -1) {
+		perror("rwlock table");
+		exit(1);
+	}
+
+	// Another thread may have given it one first
+	if (__atomic_compare_exchange_n(&rwlock->__data.__cur_writer, &id, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return fresh;
+	idFree(&rwlockTable, fresh);
+	return id;
+}
+
+// Initialize the rwlock. The kind in attr picks reader or writer preference
+int pthread_rwlock_init(pthread_rwlock_t * rwlock, const pthread_rwlockattr_t * attr) {
+
+	if (schedularCreated == 0) initSchedular();
+
+	int kind = PTHREAD_RWLOCK_PREFER_READER_NP;
+	if (attr != NULL) pthread_rwlockattr_getkind_np(attr, &kind);
+
+	int id = idAlloc(&rwlockTable);
+	if (id == -1) return ENOMEM;
+
+	// __readers as the lock word, __cur_writer as the id and __flags as the kind, which is where the initializers put it
+	memset(rwlock, 0, sizeof(*rwlock));
+	rwlock->__data.__cur_writer = id;
+	rwlock->__data.__flags = kind;
+	return 0;
+}
+
+// Destroy the rwlock, giving its id back. Returns EBUSY while it is held or waited on
+int pthread_rwlock_destroy(pthread_rwlock_t * rwlock) {
+
+	unsigned int * word = &rwlock->__data.__readers;
+	int id = rwlock->__data.__cur_writer;
+	if (id == 0) return (*word & ~RW_CONTENDED) != 0 ? EBUSY : 0;
+
+	preemptDisable();
+	RwLockObject * o = rwlockObject(id);
+	spinLock(&o->lock);
+	if ((*word & ~RW_CONTENDED) != 0 || rwWaiting(o)) {
+		spinUnlock(&o->lock);
+		preemptEnable();
+		return EBUSY;
+	}
+	spinUnlock(&o->lock);
+
+	rwlock->__data.__cur_writer = 0;
+	*word = 0;
+	idFree(&rwlockTable, id);
+	preemptEnable();
+	return 0;
+}
+
+// Take a read lock, waiting until the monotonic deadline in milliseconds, or for good if it is -1
+int readLock(pthread_rwlock_t * rwlock, long deadline) {
+
+	// No writer and nobody queued. A single CAS, so preemption can stay on
+	unsigned int * word = &rwlock->__data.__readers;
+	unsigned int w = __atomic_load_n(word, __ATOMIC_RELAXED);
+	while ((w & (RW_WRITER | RW_CONTENDED)) == 0) {
+		if (__atomic_compare_exchange_n(word, &w, w + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return 0;
+	}
+
+	preemptDisable();
+	int err = rdLock(schedular, rwlockId(rwlock), word, rwPreferWriter(rwlock), deadline);
+	preemptEnable();
+	return err;
+}
+
+// Take the write lock, waiting until the monotonic deadline in milliseconds, or for good if it is -1
+int writeLock(pthread_rwlock_t * rwlock, long deadline) {
+
+	unsigned int * word = &rwlock->__data.__readers;
+	unsigned int w = 0;
+	if (__atomic_compare_exchange_n(word, &w, RW_WRITER, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return 0;
+
+	preemptDisable();
+	int err = wrLock(schedular, rwlockId(rwlock), word, deadline);
+	preemptEnable();
+	return err;
+}
+
+// Take a read lock
+int pthread_rwlock_rdlock(pthread_rwlock_t * rwlock) {
+	return readLock(rwlock, -1);
+}
+
+// Take the write lock
+int pthread_rwlock_wrlock(pthread_rwlock_t * rwlock) {
+	return writeLock(rwlock, -1);
+}
+
+// Take a read lock only if no writer holds it and nobody is queued. Never marks it contended or gives it queues
+int pthread_rwlock_tryrdlock(pthread_rwlock_t * rwlock) {
+
+	unsigned int * word = &rwlock->__data.__readers;
+	unsigned int w = __atomic_load_n(word, __ATOMIC_RELAXED);
+	while ((w & (RW_WRITER | RW_CONTENDED)) == 0) {
+		if (__atomic_compare_exchange_n(word, &w, w + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return 0;
+	}
+	return EBUSY;
+}
+
+// Take the write lock only if it is free and nobody is queued
+int pthread_rwlock_trywrlock(pthread_rwlock_t * rwlock) {
+
+	unsigned int w = 0;
+	if (__atomic_compare_exchange_n(&rwlock->__data.__readers, &w, RW_WRITER, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return 0;
+	return EBUSY;
+}
+
+// Take a read lock, giving up with ETIMEDOUT once the CLOCK_REALTIME time abstime has passed
+int pthread_rwlock_timedrdlock(pthread_rwlock_t * rwlock, const struct timespec * abstime) {
+	if (abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000L) return EINVAL;
+	return readLock(rwlock, realtimeDeadline(abstime));
+}
+
+// Take the write lock, giving up with ETIMEDOUT once the CLOCK_REALTIME time abstime has passed
+int pthread_rwlock_timedwrlock(pthread_rwlock_t * rwlock, const struct timespec * abstime) {
+	if (abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000L) return EINVAL;
+	return writeLock(rwlock, realtimeDeadline(abstime));
+}
+
+// Drop a read or write lock
+int pthread_rwlock_unlock(pthread_rwlock_t * rwlock) {
+
+	// Nobody queued
+	unsigned int * word = &rwlock->__data.__readers;
+	unsigned int w = __atomic_load_n(word, __ATOMIC_RELAXED);
+	while ((w & RW_CONTENDED) == 0) {
+		unsigned int next = (w & RW_WRITER) ? 0 : w - 1;
+		if (__atomic_compare_exchange_n(word, &w, next, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) return 0;
+	}
+
+	preemptDisable();
+	rwUnlock(schedular, rwlockId(rwlock), word, rwPreferWriter(rwlock));
+	preemptEnable();
+	return 0;
+}
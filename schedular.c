@@ -2,482 +2,1430 @@
  * queue.c
  *
  * This file contains the implementation of the job queue
+ *
+ * Green threads run on one or more workers. A worker is a kernel thread with
+ * its own run queue: a fixed ring the worker pushes to and that it and idle
+ * workers take from, so no lock is needed to find work. Rings that overflow
+ * spill into a global queue. Wait queues and the thread table are shared by
+ * every worker and each is guarded by its own spin lock. Threads, mutexes and
+ * cond. vars are found by ids in the growable tables of idtable.c.
+ *
+ * Run queues are split into priority levels (a multi-level feedback queue).
+ * The highest non-empty level always runs first. A thread that uses up its
+ * quantum drops a level, a thread that blocks goes back to its top level, and
+ * every BOOST_INTERVAL_MS all threads go back to their top level so the lower
+ * levels can't starve.
+ *
+ * A thread waiting with a timeout is on a wait queue and on the timing wheel in
+ * timer.c at once. Whichever of its waker and its timer comes first claims it
+ * by moving its wait state on with a CAS; the loser leaves it alone.
  */
-#include <ucontext.h>
 #include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "ult.h"
+#include "context.c"
+#include "spinlock.c"
+#include "slab.c"
+#include "idtable.c"
+#include "stack.c"
 
 // Constants
-#define MAX_NUM_NODES 1000
-#define MAX_NUM_COND_VARS 1000
-#define MAX_NUM_MUTEX_VARS 1000
+#define THREAD_SLOT_BITS 32 // A pthread_t is the slot's generation above this many bits of slot index
+#define MAX_NUM_WORKERS 64
+#define RUN_QUEUE_SIZE 256 // Slots in each worker's run queue
+#define GLOBAL_QUEUE_INTERVAL 61 // Check the global queue first every this many picks so it can't starve
+#define NUM_LEVELS 4 // Priority levels, 0 is the highest
+#define BOOST_INTERVAL_MS 100 // Every thread goes back to its top level this often
+#define BOOST_CHECK_INTERVAL 4 // Picks between looking at the clock for a boost
+#define IO_POLL_INTERVAL 8 // Picks between non-blocking polls while threads are parked on I/O
+#define NUM_INLINE_KEYS 32 // Thread specific values kept in the TCB itself
+
+// Scheduling policies only defined by sched.h with _GNU_SOURCE
+#ifndef SCHED_BATCH
+#define SCHED_BATCH 3
+#endif
+#ifndef SCHED_IDLE
+#define SCHED_IDLE 5
+#endif
+
+// States of a mutex lock word
+#define MUTEX_FREE 0
+#define MUTEX_LOCKED 1 // Locked with nobody waiting, unlocking needs no schedular call
+#define MUTEX_CONTENDED 2 // Locked and there may be threads on the mutex queue
+
+// States of a wait, in the low bits of Node.waitState. The rest counts the thread's waits
+#define WAIT_WAITING 1
+#define WAIT_WOKEN 2 // Claimed by a waker
+#define WAIT_TIMEDOUT 3 // Claimed by the timer
+#define WAIT_STATE_MASK 3
+
+// States of a thread's stack for trimming
+#define TRIM_NONE 0 // Running or runnable since it last blocked, or trimming is off
+#define TRIM_PARKED 1 // Blocked and switched out, with nothing in use below parkedSp
+#define TRIM_BUSY 2 // Being trimmed. It can't be switched to until that is done
+#define TRIM_DONE 3 // Blocked and trimmed
+
+// What a thread is blocked on, for its counters and the trace
+#define BLOCK_NONE 0 // Running or runnable
+#define BLOCK_MUTEX 1 // Mutex or rwlock
+#define BLOCK_COND 2 // Cond. var, barrier, semaphore or channel
+#define BLOCK_JOIN 3
+#define BLOCK_IO 4
+#define BLOCK_SLEEP 5
+#define NUM_BLOCK_KINDS 6
+
+#ifdef ULT_TRACE
+#define TRACE_RING_SIZE 16384 // Events kept per worker. The oldest are overwritten
+
+// Kinds of trace event
+#define TRACE_SWITCH 0 // thread is switched out for other (0 is the schedular context)
+#define TRACE_BLOCK 1 // thread blocks for reason arg, a BLOCK_* kind
+#define TRACE_WAKE 2 // other makes thread runnable after it was blocked for reason arg
+#define TRACE_CREATE 3 // other creates thread
+#define TRACE_EXIT 4
+#endif
 
 
 // TCB(Thread control Block)
 typedef struct TCB {
 	pthread_t thread_id;
-	ucontext_t thread_context;
+	Context thread_context;
+	void *(*start_routine)(void *);
+	void * arg;
+	int preemptCount; // Worker's preemptCount while this thread is switched out
+	Stack * stack; // NULL for main, which runs on the process stack
+
+	// Vals for the priority levels
+	int level; // Run queue level, from topLevel down to NUM_LEVELS - 1
+	int topLevel; // Level it starts at and goes back to when it blocks
+	int schedPolicy; // From pthread_attr_setschedpolicy or pthread_setschedparam
+	int schedPriority;
+	unsigned int boostEpoch; // Last boost this thread has had
+
+	// Vals for the runtime counters
+	unsigned long numSwitches; // Times it has been switched in
+	unsigned long numYields; // Times it gave way to another thread in pthread_yield
+	unsigned long numPreempted; // Times the timer gave its worker to another thread
+	unsigned long numBlocks;
+	int blockKind; // BLOCK_* reason it is blocked
+#ifdef ULT_TRACE
+	long lastEventNs; // When it last started running, waiting to run or being blocked
+	long runNs;
+	long readyNs;
+	long blockedNs[NUM_BLOCK_KINDS];
+#endif
+
+	// Thread specific data. Keys below NUM_INLINE_KEYS are in the TCB, the rest in an array grown on demand
+	void * specific[NUM_INLINE_KEYS];
+	void ** specificOverflow;
+	int numOverflow; // Entries in specificOverflow
+
+	int runningTask; // A task pool runner in the middle of a task
+
+	// Vals for stack trimming
+	char * parkedSp; // Saved stack pointer of its context when it last blocked
+	long parkedMs; // Monotonic time it last blocked
+	volatile int trimState; // TRIM_* state of its stack
 } TCB;
 
+// FIFO of threads waiting on a cond. var, mutex or thread exit, linked through Node.next and Node.prev
+typedef struct WaitQueue {
+	struct Node * head;
+	struct Node * tail;
+} WaitQueue;
+
 // The Node for queue functionality in schedular
 typedef struct Node {
 	TCB  * thread_cb;
 	struct Node * next;
 	struct Node * prev;
-	struct Node * join_list; // this is a list of all the threads joining on this thread
+	WaitQueue join_list; // this is a list of all the threads joining on this thread. Guarded by its slot's lock
+	int handedOff; // Set by the unlocking thread when it passes its mutex straight to this waiter
+	void * joinVal; // Exit value of the thread it joined, handed over as that thread exits
+	int condMutex; // Id of the mutex a cond. var waiter takes back when it is woken
+	int * condMutexLocked; // and its lock word
+
+	// Vals for waits that can time out
+	volatile unsigned int waitState; // Wait count << 2 | WAIT_* state of the current wait
+	WaitQueue * waitQueue; // Queue it is waiting on, NULL once a waker or the timer has taken it off
+	SpinLock * waitLock; // Lock guarding that queue, or parkLock
+	SpinLock parkLock; // Held across a sleep with no queue until we are switched out
+
+	// Vals for the timing wheel, guarded by its lock
+	long timerExpiry; // Monotonic milliseconds
+	unsigned int timerWait; // waitState of the wait the timer belongs to
+	struct Node * timerNext;
+	struct Node * timerPrev;
+	struct Node ** timerSlot; // Wheel slot it is on, NULL when it is not on the wheel
 } Node;
 
+// A thread's TCB and its queue linkage, allocated together from the schedular's slab
+typedef struct ThreadBlock {
+	Node node;
+	TCB tcb;
+} __attribute__((aligned(64))) ThreadBlock;
+
+
+// States of a thread table slot
+#define SLOT_FREE 0
+#define SLOT_LIVE 1
+#define SLOT_ZOMBIE 2 // Exited, keeping its exit value until it is joined
+
+// Entry of the thread table
+typedef struct ThreadSlot {
+	int nextFree; // Link on the table's free list
+	SpinLock lock; // Guards the slot and its thread's join list
+	int state;
+	unsigned int gen; // Bumped when the slot is freed so ids of earlier threads no longer match
+	void * exitVal; // Exit value, kept until it is joined
+	int detached; // Nobody will join it, so the slot is freed as soon as it exits
+	Node * node; // The thread while it is live
+} ThreadSlot;
+
+// Entry of the mutex and cond. var tables. The id is kept in the pthread object
+typedef struct SyncObject {
+	int nextFree; // Link on the table's free list
+	SpinLock lock; // Guards the queue
+	WaitQueue queue; // Threads waiting on it
+} SyncObject;
+
+
+// Ring of runnable threads owned by one worker. Only the owner pushes; the owner and thieves pop
+typedef struct RunQueue {
+	volatile unsigned int head; // Next slot to take, advanced with CAS
+	volatile unsigned int tail; // Next slot to fill, only written by the owner
+	Node * slots[RUN_QUEUE_SIZE];
+} RunQueue;
+
+#ifdef ULT_TRACE
+// Entry of a worker's trace ring
+typedef struct TraceEvent {
+	long ns; // Monotonic time
+	pthread_t thread;
+	pthread_t other;
+	int type; // TRACE_*
+	int arg;
+} TraceEvent;
+#endif
+
+// A kernel thread running green threads
+typedef struct Worker {
+	int id;
+	pid_t tid;
+	Node * current; // Thread running on this worker, NULL in the schedular context
+	Context sched_context; // Idle loop and exited thread cleanup
+	unsigned int tick; // Number of picks, for global queue fairness and victim choice
+
+	// Vals for preemption
+	int timerArmed; // This worker's preemption timer is running
+	int timerCreated;
+	unsigned int timerGen; // Timer settings this worker's timer was made with
+	timer_t timer;
+
+	// Work left for whoever runs next on this worker, once the outgoing thread's context is saved
+	SpinLock * releaseAfterSwitch; // Wait queue lock the outgoing thread blocked under
+	Node * requeueAfterSwitch; // Yielding thread to put back on the run queue
+	Node * parkAfterSwitch; // Blocking thread whose stack can be trimmed once it is off it
+	int spawnAfterSwitch; // The task pool needs a new runner, made once the lock below is released
+	Node * exited; // Exited thread for the schedular context to free
+
+	unsigned int boostEpoch; // Last boost applied to this worker's rings
+
+	RunQueue runq[NUM_LEVELS];
+
+#ifdef ULT_TRACE
+	// Only this worker writes its ring, so recording needs no lock
+	volatile unsigned long traceHead; // Events recorded so far
+	TraceEvent trace[TRACE_RING_SIZE];
+#endif
+} __attribute__((aligned(64))) Worker;
+
+
+// Tables(maps) of the thread slots and of the cond. var and mutex queues, indexed by id.
+// Id 0 is never handed out: no thread has it, and a mutex or cond. var with id 0 hasn't been given its queue yet
+IdTable threadTable;
+IdTable condTable;
+IdTable mutexTable;
+
+// The queue of a cond. var or mutex id
+SyncObject * condObject(int id) {
+	return (SyncObject *) idEntry(&condTable, id);
+}
+
+SyncObject * mutexObject(int id) {
+	return (SyncObject *) idEntry(&mutexTable, id);
+}
+
+
+// Add n to the back of a wait queue
+void waitQueuePush(WaitQueue * q, Node * n) {
+	n->next = NULL;
+	n->prev = q->tail;
+	if (q->tail == NULL) q->head = n;
+	else q->tail->next = n;
+	q->tail = n;
+}
 
-// Array of linked lists(map) for conditional variable queues(size of the max number set)
-// Trade off: We are alocating this memory for improved speed when adding threads to the cond. var waiting queues
-struct Node *condVarMap[MAX_NUM_COND_VARS];
-struct Node *mutexVarMap[MAX_NUM_MUTEX_VARS];
+// Take the thread at the front of a wait queue, or NULL if it is empty
+Node * waitQueuePop(WaitQueue * q) {
+	Node * n = q->head;
+	if (n != NULL) {
+		q->head = n->next;
+		if (q->head == NULL) q->tail = NULL;
+		else q->head->prev = NULL;
+		n->next = NULL;
+	}
+	return n;
+}
+
+// Unlink n from anywhere in a wait queue
+void waitQueueRemove(WaitQueue * q, Node * n) {
+	if (n->prev == NULL) q->head = n->next;
+	else n->prev->next = n->next;
+	if (n->next == NULL) q->tail = n->prev;
+	else n->next->prev = n->prev;
+	n->next = NULL;
+	n->prev = NULL;
+}
 
-// Buffer for join/exit vals
-int joinVals[MAX_NUM_NODES];
+// Take the first thread on a cond. var or mutex queue that has not timed out, or NULL.
+// Call with the queue's lock held. The caller makes it runnable
+Node * takeWaiter(WaitQueue * q) {
+
+	Node * n;
+	while ((n = waitQueuePop(q)) != NULL) {
+		n->waitQueue = NULL;
+
+		// Its timer may have claimed it already, and will requeue it once we drop the lock
+		unsigned int st = n->waitState;
+		if ((st & WAIT_STATE_MASK) == WAIT_WAITING && __atomic_compare_exchange_n(&n->waitState, &st, (st & ~WAIT_STATE_MASK) | WAIT_WOKEN, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) return n;
+	}
+	return NULL;
+}
 
 // The Schedular Struct
 typedef struct Schedular {
 
-	struct Node * head; // The current executing context
-	struct Node * tail; // Back of the queue
-	int size;
+	Worker * workers[MAX_NUM_WORKERS];
+	int numWorkers;
+	volatile int numIdle; // Workers looking for work
+	volatile unsigned int wakeSeq; // Idle workers sleep on this futex word
+
+	// Shared run queue for overflow from the workers' rings, one list per level
+	SpinLock globalLock;
+	WaitQueue global[NUM_LEVELS];
+	volatile int globalSize;
+
+	// Anti-starvation boosts
+	volatile long nextBoostMs; // Monotonic time of the next boost
+
+	volatile long nextTrimMs; // Monotonic time idle workers next look for stacks to trim
+	volatile unsigned int boostEpoch; // Number of boosts so far
+
+	volatile int size; // Live threads
 	int maxSize;
+	volatile int numReady; // Threads running or runnable. 0 with threads alive means deadlock
+	volatile int numParked; // Threads blocked on an fd, which wake without help from another thread
+	volatile int numTimed; // Threads waiting with a timeout, which also wake without help
 
 	// Vals for thread lib
-	int action;
 	pthread_t numCreated;
-	pthread_t join_id;
-	ucontext_t sched_context;
+	Slab threadSlab; // ThreadBlocks, recycled when their threads exit
 
 	// Vals for synchronization
-	int nextCondId; // Id of the next cond. var in the cond. var map
-	int currCondVarId;  // Id of the cond. var under operation
-
-	int nextMutexId; // Id of the next mutex n the mutex var map
-	int currMutexVarId;  // Id of the mutex var under operation
+	int mutexPolicy; // ULT_MUTEX_HANDOFF or ULT_MUTEX_BARGING
 } Schedular;
 
 
-// Add a job to the queue
-void addThread(pthread_t *thread, Schedular * s, TCB * block) {
-	//fprintf(stdout,"addJob\n");
+// The I/O reactor, in io.c
+void pollIoNow(Schedular * s);
+int pollIoIdle(Schedular * s, unsigned int seq, int timeout);
+void wakePoller(void);
 
-	// Add thread to ready queue if not full 
-	if (canCreateThread(s)) {
+// The task pool, in task.c
+int taskBlocked(Schedular * s);
+void taskResumed(Schedular * s);
+int spawnRunner(Schedular * s);
 
-		Node * temp = (Node *) malloc(sizeof(Node));
+// The timing wheel, in timer.c
+void addTimer(Schedular * s, Node * n, long expiry);
+void cancelTimer(Schedular * s, Node * n);
+void runTimers(Schedular * s);
+int nextTimerDelay(Schedular * s);
 
-		// Thrad ID of the block
-		block->thread_id = ++s->numCreated;
-		*thread = s->numCreated;
-		
-		temp->thread_cb = block;
-		temp->next = NULL;
-		temp->join_list = NULL;
-
-		// The first job added to the list
-		if (s->head == NULL) {
-			s->head = temp;
-			s->tail = temp;
-			s->head->prev = NULL;
+// Defined further down
+void unlock(Schedular * s, int id, int * locked);
+void addToReadyTail(Schedular * s, WaitQueue * queue);
+void printReadyQueue(Schedular * s);
+int canCreateThread(Schedular * s);
 
-		} else {
-			s->tail->next = temp;
-			s->tail->next->prev = s->tail;
-			s->tail = temp;
-		}
 
-		// Increment the size of the schedular queue
-		s->size++;
+// The worker running on this kernel thread
+__thread Worker * currWorker;
 
-		//printf("Created new thread.\n");
-		printReadyQueue(s);
+// Nesting depth of critical sections on this worker. The timer only switches threads at 0.
+// Kept per kernel thread so it is read and written relative to the thread pointer, never through
+// a worker pointer that may be stale by the time the timer has moved the thread to another worker
+__thread volatile int preemptCount;
+__thread volatile int yieldPending; // The timer fired inside a critical section
+__thread void ** currSpecific; // Inline thread specific values of the running thread. Read in one load, so never stale
 
-	}
+// The worker running the caller. Not inlined so it is re-read after every switch, which may change kernel thread
+__attribute__((noinline)) Worker * currentWorker(void) {
+	__asm__ volatile("" ::: "memory");
+	return currWorker;
 }
 
 
-// Run the next thread in the ready queue
-void runNextThread(Schedular * s) {
-	//printf("rn1\n");
+/************************ COUNTERS ****************************/
 
-	// if there is more than one node on the ready queue, move the head to the back
-	if(s->tail != s->head) { 
-		//printf("rn2\n");
 
-		// Add current TCB to the back of queue
-		s->tail->next = s->head;
-		s->tail->next->prev = s->tail;
+#ifdef ULT_TRACE
+// Monotonic time in nanoseconds
+long traceNs(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000L + now.tv_nsec;
+}
 
-		// Set the new head 
-		s->head = s->head->next;
-		s->head->prev = NULL;
+// Put an event on w's trace ring
+void traceEvent(Worker * w, long ns, int type, Node * thread, Node * other, int arg) {
+	TraceEvent * e = &w->trace[w->traceHead % TRACE_RING_SIZE];
+	e->ns = ns;
+	e->type = type;
+	e->thread = thread != NULL ? thread->thread_cb->thread_id : 0;
+	e->other = other != NULL ? other->thread_cb->thread_id : 0;
+	e->arg = arg;
+	__atomic_store_n(&w->traceHead, w->traceHead + 1, __ATOMIC_RELEASE);
+}
+#endif
 
-		// Set the tail correctly
-		s->tail = s->tail->next;
-		s->tail->next = NULL;
-		//printf("rn3\n");
-	}
-	//printf("rn4\n");
+// Record that the running thread n is blocking for reason kind
+void noteBlock(Worker * w, Node * n, int kind) {
 
-	// If a thread terminates, this calls pthread exit for it 
-	s->action = 0;
+	n->thread_cb->numBlocks++;
+	n->thread_cb->blockKind = kind;
 
-	//printf("Yielded.\n");
-	printReadyQueue(s);
+#ifdef ULT_TRACE
+	traceEvent(w, traceNs(), TRACE_BLOCK, n, NULL, kind);
+#endif
+}
 
-	// Change context to new TCB context
-	swapcontext(&s->sched_context,&s->head->thread_cb->thread_context);
+// Record that n is runnable again, or for the first time, on w
+void noteReady(Worker * w, Node * n) {
 
+#ifdef ULT_TRACE
+	int kind = n->thread_cb->blockKind;
+#endif
+	n->thread_cb->blockKind = BLOCK_NONE;
 
+#ifdef ULT_TRACE
+	long ns = traceNs();
+	n->thread_cb->blockedNs[kind] += ns - n->thread_cb->lastEventNs;
+	n->thread_cb->lastEventNs = ns;
+	if (kind != BLOCK_NONE) traceEvent(w, ns, TRACE_WAKE, n, w->current, kind);
+#endif
 }
 
+// Count a switch on w from prev to next. Either is NULL for the schedular context
+void noteSwitch(Worker * w, Node * prev, Node * next) {
 
-// Exit the current running thread
-void currExit(Schedular * s) {
+	if (next != NULL) {
+		next->thread_cb->numSwitches++;
 
-	
-	Node * temp = s->head->join_list;
+		// Woken by readyLists, which leaves this until it runs
+		if (next->thread_cb->blockKind != BLOCK_NONE) noteReady(w, next);
+	}
 
+#ifdef ULT_TRACE
+	long ns = traceNs();
+	if (prev != NULL) {
+		prev->thread_cb->runNs += ns - prev->thread_cb->lastEventNs;
+		prev->thread_cb->lastEventNs = ns;
+	}
+	if (next != NULL) {
+		next->thread_cb->readyNs += ns - next->thread_cb->lastEventNs;
+		next->thread_cb->lastEventNs = ns;
+	}
+	traceEvent(w, ns, TRACE_SWITCH, prev, next, 0);
+#endif
+}
 
-	// Add list of joins from current TCB to back of ready queue
-	while (temp != NULL) {
+// Clear the counters of a new thread
+void resetCounters(TCB * t) {
+
+	t->numSwitches = 0;
+	t->numYields = 0;
+	t->numPreempted = 0;
+	t->numBlocks = 0;
+	t->blockKind = BLOCK_NONE;
+
+#ifdef ULT_TRACE
+	t->lastEventNs = traceNs();
+	t->runNs = 0;
+	t->readyNs = 0;
+	int i;
+	for (i = 0; i < NUM_BLOCK_KINDS; i++) t->blockedNs[i] = 0;
+#endif
+}
 
-		//printf("adding back to ready queue\n");
 
-		// Add temp to the back of the queue
-		s->tail->next = temp;
-		s->tail->next->prev = s->tail;
+/************************ RUN QUEUES ****************************/
 
-		// Set temp to the next node in the joining list
-		temp = temp->next;
 
-		// Set tail to the end of ready queue
-		s->tail = s->tail->next;
-		s->tail->next = NULL;
+// Run queue level for a scheduling policy. Real time threads start highest, batch and idle ones lowest
+int levelForPolicy(int policy, int priority) {
+	if ((policy == SCHED_FIFO || policy == SCHED_RR) && priority > 0) return 0;
+	if (policy == SCHED_BATCH) return NUM_LEVELS - 2;
+	if (policy == SCHED_IDLE) return NUM_LEVELS - 1;
+	return 1;
+}
 
-	}
+// Give a thread a scheduling policy and priority and start it at the top level they allow
+void setSchedParams(Schedular * s, TCB * t, int policy, int priority) {
+	t->schedPolicy = policy;
+	t->schedPriority = priority;
+	t->topLevel = levelForPolicy(policy, priority);
+	t->level = t->topLevel;
+	t->boostEpoch = s->boostEpoch;
+}
 
-	
-	temp = s->head; 
+// Put a runnable thread on the back of the worker's ring for its level, or the global queue if the ring is full
+void pushRunnable(Schedular * s, Worker * w, Node * n) {
 
-	// Set the next thread in the ready queue to the head
-	if (s->head == s->tail) {
-		s->head = NULL;
-		s->tail = NULL;
-	} else {
-		s->head = s->head->next;
-		s->head->prev = NULL;
+	// Missed a boost while it was running or blocked
+	TCB * t = n->thread_cb;
+	if (t->boostEpoch != s->boostEpoch) {
+		t->boostEpoch = s->boostEpoch;
+		t->level = t->topLevel;
 	}
 
-	// delete the memory of this node
-	free(temp); 
+	RunQueue * q = &w->runq[t->level];
+	unsigned int tail = q->tail;
+	unsigned int h = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
 
-	// Decrement the size of the queue
-	s->size--;
-	// If a thread terminates, this calls pthread exit for it 
-	s->action = 0;
+	if (tail - h < RUN_QUEUE_SIZE) {
+		__atomic_store_n(&q->slots[tail % RUN_QUEUE_SIZE], n, __ATOMIC_RELAXED);
+		__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+		return;
+	}
 
-	//printf("Exited thread.\n");
-	printReadyQueue(s);
+	// Ring is full
+	spinLock(&s->globalLock);
+	waitQueuePush(&s->global[t->level], n);
+	s->globalSize++;
+	spinUnlock(&s->globalLock);
+}
+
+// Take the thread at the front of a worker's ring. Safe to call from any worker
+Node * popRunnable(RunQueue * q) {
 
-	// Unless the last thread has exited, swap back to user mode
-	if (s->head != NULL) {
-		// Change context to new TCB context
-		swapcontext(&s->sched_context,&s->head->thread_cb->thread_context);
-	} 
+	while (1) {
+		unsigned int h = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+		unsigned int t = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+		if (t == h) return NULL;
 
+		Node * n = __atomic_load_n(&q->slots[h % RUN_QUEUE_SIZE], __ATOMIC_RELAXED);
+		if (__atomic_compare_exchange_n(&q->head, &h, h + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) return n;
+	}
 }
 
-// Find node with TCB thread_id == id
-Node * findTarget(Node * root, pthread_t id) {
+// Move half of a victim's ring onto the thief's empty ring of the same level and return one of the stolen threads
+Node * stealRunnable(RunQueue * thief, RunQueue * victim) {
+
+	while (1) {
+		unsigned int h = __atomic_load_n(&victim->head, __ATOMIC_ACQUIRE);
+		unsigned int t = __atomic_load_n(&victim->tail, __ATOMIC_ACQUIRE);
+		unsigned int n = t - h;
+		n = n - n / 2;
+		if (n == 0 || n > RUN_QUEUE_SIZE) return NULL;
+
+		// Copy first, then claim. The owner can't refill these slots until head moves past them
+		unsigned int mine = thief->tail;
+		unsigned int i;
+		for (i = 0; i < n; i++) {
+			Node * temp = __atomic_load_n(&victim->slots[(h + i) % RUN_QUEUE_SIZE], __ATOMIC_RELAXED);
+			__atomic_store_n(&thief->slots[(mine + i) % RUN_QUEUE_SIZE], temp, __ATOMIC_RELAXED);
+		}
+		if (!__atomic_compare_exchange_n(&victim->head, &h, h + n, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) continue;
 
-	// Check if we hit a dead end
-	if (root == NULL) {
-		//printf("root null\n");
-		return NULL;
+		// Keep the last one to run now, publish the rest
+		Node * temp = thief->slots[(mine + n - 1) % RUN_QUEUE_SIZE];
+		if (n > 1) __atomic_store_n(&thief->tail, mine + n - 1, __ATOMIC_RELEASE);
+		return temp;
 	}
+}
+
+// Take the thread at the front of the highest global list no lower than maxLevel
+Node * popGlobal(Schedular * s, int maxLevel) {
 
-	// Check if we have the correct node
-	if (root->thread_cb->thread_id == id) {
-		//printf("returning root\n");
-		return root;
+	if (s->globalSize == 0) return NULL;
+
+	Node * n = NULL;
+	int level;
+	spinLock(&s->globalLock);
+	for (level = 0; level <= maxLevel && n == NULL; level++) {
+		n = waitQueuePop(&s->global[level]);
 	}
+	if (n != NULL) s->globalSize--;
+	spinUnlock(&s->globalLock);
+
+	return n;
+}
 
-	// Recursively search for the correct node
-	Node* n = findTarget(root->next,id);
-	Node* j = findTarget(root->join_list,id);
+// Milliseconds on the monotonic clock
+long monotonicMs(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
 
-	// Return recursive result
-	return (j==NULL) ? n : j;
+// Put every queued thread of w back at its top level if a boost is due or has happened since w last looked
+void boostIfDue(Schedular * s, Worker * w) {
+
+	long ms = monotonicMs();
+
+	// One worker starts each boost and moves the global lists
+	long due = s->nextBoostMs;
+	if (ms >= due && __atomic_compare_exchange_n(&s->nextBoostMs, &due, ms + BOOST_INTERVAL_MS, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		spinLock(&s->globalLock);
+		__atomic_add_fetch(&s->boostEpoch, 1, __ATOMIC_RELAXED);
+		int level;
+		for (level = 1; level < NUM_LEVELS; level++) {
+			WaitQueue moved = s->global[level];
+			s->global[level].head = NULL;
+			s->global[level].tail = NULL;
+			Node * n;
+			while ((n = waitQueuePop(&moved)) != NULL) {
+				n->thread_cb->boostEpoch = s->boostEpoch;
+				n->thread_cb->level = n->thread_cb->topLevel;
+				waitQueuePush(&s->global[n->thread_cb->level], n);
+			}
+		}
+		spinUnlock(&s->globalLock);
+	}
 
+	// Every worker moves its own rings
+	if (w->boostEpoch == s->boostEpoch) return;
+	w->boostEpoch = s->boostEpoch;
 
+	int level;
+	for (level = 1; level < NUM_LEVELS; level++) {
+		RunQueue * q = &w->runq[level];
+		unsigned int count = q->tail - q->head;
+		Node * n;
+		while (count-- > 0 && (n = popRunnable(q)) != NULL) pushRunnable(s, w, n);
+	}
 }
 
-// Look through the mutex and cond. var queues to find the joining thread
-Node * findTargetInMaps(Schedular * s, pthread_t id) {
+// Find the next thread for w to run, no lower than maxLevel. Each level is looked for in
+// the worker's own ring, then the global queue, then other workers' rings
+Node * findRunnable(Schedular * s, Worker * w, int maxLevel) {
+
+	Node * n;
+	w->tick++;
+
+	if (w->tick % BOOST_CHECK_INTERVAL == 0) boostIfDue(s, w);
 
-	Node * temp;
-	int i,j;
+	if (w->tick % GLOBAL_QUEUE_INTERVAL == 0 && (n = popGlobal(s, maxLevel)) != NULL) return n;
 
-	// Search through cond. var map for the thread
-	for (i=0; i<s->nextCondId; i++) {
-		temp = condVarMap[i];
+	int level;
+	for (level = 0; level <= maxLevel; level++) {
+		if ((n = popRunnable(&w->runq[level])) != NULL) return n;
+		if ((n = popGlobal(s, level)) != NULL) return n;
 
-		if (temp == NULL) continue;
-		while(temp != NULL) {
-			if (temp->thread_cb->thread_id == id) return temp;
-			temp = temp->next;
+		int i;
+		for (i = 1; i < s->numWorkers; i++) {
+			Worker * victim = s->workers[(w->id + w->tick + i) % s->numWorkers];
+			if (victim == w || victim == NULL) continue;
+			if ((n = stealRunnable(&w->runq[level], &victim->runq[level])) != NULL) return n;
 		}
 	}
 
-	// Search through mutex for the thread
-	for (j=0; j<s->nextMutexId; j++) {
-		temp = mutexVarMap[j];
+	return NULL;
+}
 
-		if (temp == NULL) continue;
-		while(temp != NULL) {
-			if (temp->thread_cb->thread_id == id) return temp;
-			temp = temp->next;
-		}
+// Sleep on a futex word while it still holds val, for at most timeout milliseconds. -1 waits for good
+void futexWait(volatile unsigned int * addr, unsigned int val, int timeout) {
+	struct timespec ts;
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = (timeout % 1000) * 1000000L;
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout < 0 ? NULL : &ts, NULL, 0);
+}
+
+// Wake up to n threads sleeping on a futex word
+void futexWake(volatile unsigned int * addr, int n) {
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+// Wake an idle worker, if there is one, so it can take newly runnable work
+void wakeIdleWorker(Schedular * s) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&s->numIdle, __ATOMIC_RELAXED) > 0) {
+		__atomic_add_fetch(&s->wakeSeq, 1, __ATOMIC_SEQ_CST);
+		futexWake(&s->wakeSeq, 1);
+		wakePoller();
 	}
 }
 
-// Join current running thread to another thread
-void join(Schedular * s) {
+// Make a blocked or new thread runnable on the calling worker
+void readyThread(Schedular * s, Node * n) {
+	__atomic_add_fetch(&s->numReady, 1, __ATOMIC_SEQ_CST);
+	noteReady(currentWorker(), n);
+	pushRunnable(s, currentWorker(), n);
+	wakeIdleWorker(s);
+}
 
-	// Find the thread we are joing on
-	Node * temp = findTarget(s->head, s->join_id);
+// Make the n threads on lists runnable at once by splicing each list onto the global queue in O(1). lists has one
+// list per level, and each thread must be on the list of its top level. The threads must not be waiting with a
+// timeout. Their blocked reasons are cleared by noteSwitch when they next run, so the lists aren't walked
+void readyLists(Schedular * s, WaitQueue * lists, int n) {
 
-	if (temp == NULL) findTargetInMaps(s,s->join_id);
+	if (n == 0) return;
 
-	if (temp != NULL) {
+	__atomic_add_fetch(&s->numReady, n, __ATOMIC_SEQ_CST);
 
-		//printf("temp not null\n");
+	spinLock(&s->globalLock);
+	int level;
+	for (level = 0; level < NUM_LEVELS; level++) {
+		WaitQueue * l = &lists[level];
+		WaitQueue * g = &s->global[level];
+		if (l->head == NULL) continue;
 
-		// Add current TCB to back of its joining queue
-		if (temp->join_list == NULL) {
-			//printf("jo1\n");
-			temp->join_list = s->head; 
-			temp = temp->join_list;
-		} else {
-			//printf("jo2\n");
-			temp = temp->join_list;
-			while (temp->next != NULL) temp = temp->next;
-			temp->next = s->head;
-			temp = temp->next;
+		l->head->prev = g->tail;
+		if (g->tail == NULL) g->head = l->head;
+		else g->tail->next = l->head;
+		g->tail = l->tail;
+	}
+	s->globalSize += n;
+	spinUnlock(&s->globalLock);
+
+	// Enough idle workers to take them all
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&s->numIdle, __ATOMIC_RELAXED) > 0) {
+		__atomic_add_fetch(&s->wakeSeq, 1, __ATOMIC_SEQ_CST);
+		futexWake(&s->wakeSeq, n);
+		wakePoller();
+	}
+}
+
+// Give back the unused stack pages of threads blocked for at least stackTrimMs. One idle worker
+// looks every stackTrimMs, and walks the thread table
+void trimParkedStacks(Schedular * s) {
+
+	long ms = monotonicMs();
+	long due = s->nextTrimMs;
+	if (ms < due || !__atomic_compare_exchange_n(&s->nextTrimMs, &due, ms + stackTrimMs, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return;
+
+	int i;
+	int end = __atomic_load_n(&threadTable.nextUnused, __ATOMIC_ACQUIRE);
+	for (i = 1; i < end; i++) {
+		ThreadSlot * slot = (ThreadSlot *) idEntry(&threadTable, i);
+		spinLock(&slot->lock);
+		TCB * t = slot->state == SLOT_LIVE ? slot->node->thread_cb : NULL;
+
+		// Once it is ours it can't run, or exit, until we let it go
+		int st = TRIM_PARKED;
+		if (t == NULL || t->stack == NULL || !__atomic_compare_exchange_n(&t->trimState, &st, TRIM_BUSY, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			spinUnlock(&slot->lock);
+			continue;
+		}
+		spinUnlock(&slot->lock);
+
+		if (ms - t->parkedMs >= stackTrimMs) {
+			trimStack(t->stack, t->parkedSp);
+			st = TRIM_DONE;
 		}
+		__atomic_store_n(&t->trimState, st, __ATOMIC_RELEASE);
+	}
+}
+
+// Take back t's stack from trimming before switching to it, waiting out a trim that has started
+void claimStack(TCB * t) {
+	int st;
+	while ((st = __atomic_load_n(&t->trimState, __ATOMIC_ACQUIRE)) != TRIM_NONE) {
+		if (st != TRIM_BUSY && __atomic_compare_exchange_n(&t->trimState, &st, TRIM_NONE, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return;
+		cpuRelax();
+	}
+}
+
+// Wait in the schedular context until there is a thread to run
+Node * waitForWork(Schedular * s, Worker * w) {
+
+	pollIoNow(s);
+	runTimers(s);
+
+	Node * n = findRunnable(s, w, NUM_LEVELS - 1);
+	if (n != NULL) return n;
 
-		// Set head of ready queue to current
-		s->head = s->head->next;
+	__atomic_add_fetch(&s->numIdle, 1, __ATOMIC_SEQ_CST);
+	while (1) {
+		unsigned int seq = __atomic_load_n(&s->wakeSeq, __ATOMIC_SEQ_CST);
 
-		// Check for deadlock
-		if(s->head==NULL) {
+		if ((n = findRunnable(s, w, NUM_LEVELS - 1)) != NULL) break;
+
+		// Nothing is running or runnable but threads are still alive, so they all wait on each other
+		if (__atomic_load_n(&s->numReady, __ATOMIC_SEQ_CST) == 0 && s->numParked == 0 && s->numTimed == 0 && s->size > 0) {
 			//printf("Deadlock achieved!\nExiting now....\n");
 			exit(0);
 		}
 
-		s->head->prev = NULL;
+		// Idle time is when stacks get trimmed, so come back for the next look
+		int timeout = nextTimerDelay(s);
+		if (stackTrimMs > 0) {
+			trimParkedStacks(s);
+			if (timeout < 0 || timeout > stackTrimMs) timeout = stackTrimMs;
+		}
+
+		// One idle worker waits for I/O, the rest for work to be queued. Both stop at the next timer
+		if (!pollIoIdle(s, seq, timeout)) futexWait(&s->wakeSeq, seq, timeout);
+
+		runTimers(s);
+	}
+	__atomic_sub_fetch(&s->numIdle, 1, __ATOMIC_SEQ_CST);
+
+	return n;
+}
 
-		// Make the end of the join list NULL
-		temp->next = NULL;
 
-		// If a thread terminates, this calls pthread exit for it 
-		s->action = 0;
+/************************ THREADS ****************************/
 
-		//if (s->head->join_list == NULL) printf("joinlist is null\n");
 
-		//printf("Thread join.\n");
+// Set up the thread, cond. var and mutex tables. Freed thread slots are reused oldest first, so exit values
+// and generations last as long as possible
+void makeIdTables(Schedular * s) {
+	idTableInit(&threadTable, sizeof(ThreadSlot), 1);
+	idTableInit(&condTable, sizeof(SyncObject), 1);
+	idTableInit(&mutexTable, sizeof(SyncObject), 1);
+}
+
+// Slot index of a thread id
+int slotIndex(pthread_t id) {
+	return (int) (id & ((1UL << THREAD_SLOT_BITS) - 1));
+}
+
+// The slot a thread id refers to, or NULL if it is out of range. The caller checks the generation
+ThreadSlot * threadSlot(Schedular * s, pthread_t id) {
+	int i = slotIndex(id);
+	if (i <= 0) return NULL;
+	return (ThreadSlot *) idLookup(&threadTable, i);
+}
+
+// Take a free slot for node and return its index, or -1 if there is no memory for another
+int allocSlot(Schedular * s, Node * node, int detached) {
+
+	int i = idAlloc(&threadTable);
+	if (i == -1) return -1;
+
+	ThreadSlot * slot = (ThreadSlot *) idEntry(&threadTable, i);
+	spinLock(&slot->lock);
+	slot->state = SLOT_LIVE;
+	slot->exitVal = NULL;
+	slot->detached = detached;
+	slot->node = node;
+	spinUnlock(&slot->lock);
+
+	return i;
+}
+
+// Free slot i. Call with its lock held, which this releases
+void releaseSlot(Schedular * s, int i) {
+
+	ThreadSlot * slot = (ThreadSlot *) idEntry(&threadTable, i);
+	slot->state = SLOT_FREE;
+	slot->gen++;
+	spinUnlock(&slot->lock);
+
+	// Back of the free list
+	idFree(&threadTable, i);
+}
+
+// Add a job to the queue. A detached thread can't be joined. Returns 0, or EAGAIN if there is no room for another thread
+int addThread(pthread_t *thread, Schedular * s, ThreadBlock * tb, int running, int detached) {
+	//fprintf(stdout,"addJob\n");
+
+	// Add thread to ready queue if not full
+	if (canCreateThread(s)) {
+
+		Node * temp = &tb->node;
+		TCB * block = &tb->tcb;
+
+		temp->thread_cb = block;
+		resetCounters(block);
+		memset(block->specific, 0, sizeof(block->specific));
+		block->specificOverflow = NULL;
+		block->numOverflow = 0;
+		block->runningTask = 0;
+		block->trimState = TRIM_NONE;
+		temp->next = NULL;
+		temp->join_list.head = NULL;
+		temp->join_list.tail = NULL;
+		temp->handedOff = 0;
+		temp->waitQueue = NULL;
+		temp->timerSlot = NULL;
+
+		// Thrad ID of the block
+		int i = allocSlot(s, temp, detached);
+		if (i == -1) return EAGAIN;
+		block->thread_id = ((pthread_t) ((ThreadSlot *) idEntry(&threadTable, i))->gen << THREAD_SLOT_BITS) | i;
+		*thread = block->thread_id;
+
+		__atomic_add_fetch(&s->numCreated, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&s->size, 1, __ATOMIC_SEQ_CST);
+
+#ifdef ULT_TRACE
+		traceEvent(currentWorker(), traceNs(), TRACE_CREATE, temp, currentWorker()->current, 0);
+#endif
+
+		// main is already running, everything else goes on the run queue
+		if (running) {
+			__atomic_add_fetch(&s->numReady, 1, __ATOMIC_SEQ_CST);
+			currentWorker()->current = temp;
+			currSpecific = block->specific;
+		} else {
+			readyThread(s, temp);
+		}
+
+		//printf("Created new thread.\n");
 		printReadyQueue(s);
 
-		// Change context to current TCB context
-		swapcontext(&s->sched_context,&s->head->thread_cb->thread_context);
+		return 0;
+	}
+
+	return EAGAIN;
+}
 
 
-	} else {
-		//printf("temp is null\n");
-		// If a thread terminates, this calls pthread exit for it 
-		s->action = 0;
+// Finish a switch on whichever worker we were resumed on
+void afterSwitch(Schedular * s) {
 
-		// Change context to current TCB context
-		swapcontext(&s->sched_context,&s->head->thread_cb->thread_context);
+	Worker * w = currentWorker();
+
+	// Critical sections can nest across a switch, so each thread keeps its own depth
+	if (w->current != NULL) {
+		preemptCount = w->current->thread_cb->preemptCount;
+		currSpecific = w->current->thread_cb->specific;
+	}
+
+	// Nothing runs on the blocked thread's stack any more, and it can't be woken until the lock below is released
+	if (w->parkAfterSwitch != NULL) {
+		TCB * t = w->parkAfterSwitch->thread_cb;
+		w->parkAfterSwitch = NULL;
+		t->parkedSp = (char *) contextSp(&t->thread_context);
+		if (t->parkedSp != NULL) {
+			t->parkedMs = monotonicMs();
+			__atomic_store_n(&t->trimState, TRIM_PARKED, __ATOMIC_RELEASE);
+		}
+	}
+
+	// The thread we switched away from is saved now, so it is safe for another worker to pick it up
+	if (w->releaseAfterSwitch != NULL) {
+		spinUnlock(w->releaseAfterSwitch);
+		w->releaseAfterSwitch = NULL;
+	}
+
+	// Making a thread takes a while, so it is kept out of the lock a blocking task held
+	if (w->spawnAfterSwitch) {
+		w->spawnAfterSwitch = 0;
+		spawnRunner(s);
+	}
+	if (w->requeueAfterSwitch != NULL) {
+		pushRunnable(s, w, w->requeueAfterSwitch);
+		w->requeueAfterSwitch = NULL;
+		wakeIdleWorker(s);
 	}
 }
 
-// Add the current thread to the correct conditional variable queue
-void waitOnCond (Schedular *s) {
+// Switch from prev to next, or to the worker's schedular context if next is NULL
+void switchThread(Schedular * s, Worker * w, Node * prev, Node * next) {
 
-	// Get the first node in the queue 
-	Node * temp = condVarMap[s->currCondVarId];
-	//printf("wc1\n");
-	// Add the current thread to the back of the list
-	if (temp == NULL) {
-		//printf("wc1.5: %d\n",s->currCondVarId);
-		condVarMap[s->currCondVarId] = s->head;
-		//printf("wc2\n");
-		temp = s->head;
+	// The next thread gets a fresh quantum
+	yieldPending = 0;
+
+	prev->thread_cb->preemptCount = preemptCount;
+	noteSwitch(w, prev, next);
+	w->current = next;
+	if (next != NULL && next->thread_cb->trimState != TRIM_NONE) claimStack(next->thread_cb);
+
+	if (next == NULL) {
+		switchContext(&prev->thread_cb->thread_context, &w->sched_context);
 	} else {
-		//printf("wc2.5\n");
-		printReadyQueue(s);
-		while(temp->next != NULL) temp = temp->next;
-		//printf("wc3\n");
-		temp->next = s->head;
-		temp = temp->next;
+		switchContext(&prev->thread_cb->thread_context, &next->thread_cb->thread_context);
 	}
 
-	//printf("%d\n",temp->thread_cb->thread_id);
+	afterSwitch(s);
+}
+
+
+// Run the next thread in the ready queue
+void runNextThread(Schedular * s) {
+	//printf("rn1\n");
 
-	// Set head of ready queue to current
-	//printf("wc4\n");
-	s->head = s->head->next;
+	Worker * w = currentWorker();
+	Node * prev = w->current;
 
-	// Check for deadlock
-	if(s->head==NULL) {
-		//printf("Deadlock achieved!\nExiting now....\n");
-		exit(0);
+	// Threads parked on I/O or timers may have become ready. Not done when blocking, since the caller holds a wait queue lock
+	if (w->tick % IO_POLL_INTERVAL == 0) {
+		pollIoNow(s);
+		runTimers(s);
 	}
-	//printf("wc5\n");
-	s->head->prev = NULL;
 
-	// Make the end of the join list NULL
-	temp->next = NULL;
+	// Keep running if nothing else is runnable
+	Node * next = findRunnable(s, w, NUM_LEVELS - 1);
+	if (next == NULL) return;
+
+	// Go to the back of the queue once our context is saved
+	w->requeueAfterSwitch = prev;
+	prev->thread_cb->numYields++;
+
+	//printf("Yielded.\n");
+	printReadyQueue(s);
+
+	// Change context to new TCB context
+	switchThread(s, w, prev, next);
+}
+
+// Run n, which the caller has just woken, on this worker at once, and put the caller at the back of the run queue.
+// For handing a value to a thread that was waiting for it. n must be switched out already
+void switchToThread(Schedular * s, Node * n) {
+
+	Worker * w = currentWorker();
+	Node * prev = w->current;
+
+	__atomic_add_fetch(&s->numReady, 1, __ATOMIC_SEQ_CST);
+	noteReady(w, n);
+
+	w->requeueAfterSwitch = prev;
+	switchThread(s, w, prev, n);
+}
+
+// The running thread used up its quantum. Drop it a level and switch if anything at least as important is waiting
+void preemptThread(Schedular * s) {
+
+	Worker * w = currentWorker();
+	Node * prev = w->current;
+	TCB * t = prev->thread_cb;
+
+	if (t->level < NUM_LEVELS - 1) t->level++;
+
+	// Threads parked on I/O or timers may have become ready since the last pick
+	pollIoNow(s);
+	runTimers(s);
+
+	// Keep running if everything waiting is less important
+	Node * next = findRunnable(s, w, t->level);
+	if (next == NULL) return;
 
-	// If a thread terminates, this calls pthread exit for it 
-	s->action = 0;
+	w->requeueAfterSwitch = prev;
+	t->numPreempted++;
+	switchThread(s, w, prev, next);
+}
+
+// Give up the worker until another thread makes us runnable again. held is released once we are switched out.
+// kind is the BLOCK_* reason, for the counters
+void blockThread(Schedular * s, SpinLock * held, int kind) {
+
+	Worker * w = currentWorker();
+	Node * prev = w->current;
+
+	noteBlock(w, prev, kind);
+
+	// Threads that block are interactive, so they come back at their top level
+	prev->thread_cb->level = prev->thread_cb->topLevel;
 
-	// Change context to current TCB context
-	//printf("%d\n",s->head->thread_cb->thread_id);
+	__atomic_sub_fetch(&s->numReady, 1, __ATOMIC_SEQ_CST);
 
-	swapcontext(&s->sched_context,&s->head->thread_cb->thread_context);
+	// Our stack can be trimmed once the switch has saved where it ends
+	if (stackTrimMs > 0 && prev->thread_cb->stack != NULL) w->parkAfterSwitch = prev;
 
+	// A task that blocks keeps its runner. Another runner takes over the queued tasks
+	int inTask = prev->thread_cb->runningTask;
+	if (inTask) w->spawnAfterSwitch = taskBlocked(s);
+
+	w->releaseAfterSwitch = held;
+	switchThread(s, w, prev, findRunnable(s, w, NUM_LEVELS - 1));
+
+	if (inTask) taskResumed(s);
 }
 
-// Take the head of the cond. var queue and put it back on the ready queue
-void sig(Schedular *s) {
+// Block on q, which held guards, until a waker takes us off it with takeWaiter or the monotonic
+// deadline in milliseconds passes. q is NULL for a plain sleep under parkLock, and deadline -1 never
+// times out. kind is the BLOCK_* reason. Call with held taken. Returns 0, or ETIMEDOUT if the timer woke us
+int parkThread(Schedular * s, WaitQueue * q, SpinLock * held, long deadline, int kind) {
 
-	// Get the head of the queue
-	Node * temp = condVarMap[s->currCondVarId];
+	Node * self = currentWorker()->current;
 
-	if (temp != NULL) {
-		
-		addToReadyTail(temp,s,0);
+	// Already too late to wait
+	if (deadline >= 0 && deadline <= monotonicMs()) {
+		spinUnlock(held);
+		return ETIMEDOUT;
 	}
 
-	// If a thread terminates, this calls pthread exit for it 
-	s->action = 0;
+	// A new wait, so a timer left over from an earlier one can't claim it
+	self->waitState = (self->waitState & ~WAIT_STATE_MASK) + (1 << 2) + WAIT_WAITING;
+	self->waitLock = held;
+	self->waitQueue = q;
+	if (q != NULL) waitQueuePush(q, self);
+	if (deadline >= 0) addTimer(s, self, deadline);
+
+	blockThread(s, held, kind);
+
+	if ((self->waitState & WAIT_STATE_MASK) == WAIT_TIMEDOUT) return ETIMEDOUT;
 
-	// Change context to current TCB context
-	swapcontext(&s->sched_context,&s->head->thread_cb->thread_context);
+	// A waker beat the timer. It may still be on the wheel
+	if (deadline >= 0) cancelTimer(s, self);
+	return 0;
 }
 
-// Add all threads waiting on the cond. variable back on the ready queue
-void broadcast (Schedular *s) {
+// Leave the running thread for good. The worker's schedular context frees it
+void exitThread(Schedular * s) {
+
+	Worker * w = currentWorker();
+	Node * prev = w->current;
+
+	w->exited = prev;
+	noteSwitch(w, prev, NULL);
+	w->current = NULL;
+	switchContext(&prev->thread_cb->thread_context, &w->sched_context);
+}
+
+
+// Exit a thread. Runs on the schedular stack of the worker it last ran on
+void currExit(Schedular * s, Node * temp) {
+
+	int i = slotIndex(temp->thread_cb->thread_id);
+	ThreadSlot * slot = (ThreadSlot *) idEntry(&threadTable, i);
+
+#ifdef ULT_TRACE
+	traceEvent(currentWorker(), traceNs(), TRACE_EXIT, temp, NULL, 0);
+#endif
+
+	spinLock(&slot->lock);
+	slot->node = NULL;
 
-	// Get the head of the queue
-	Node * temp = condVarMap[s->currCondVarId];
+	// Nobody has joined yet. Keep the slot and its exit value for the thread that does, unless nobody will
+	Node * joiner = temp->join_list.head;
+	if (joiner == NULL) {
+		if (slot->detached) {
+			releaseSlot(s, i);
+		} else {
+			slot->state = SLOT_ZOMBIE;
+			spinUnlock(&slot->lock);
+		}
+	}
 
-	// Add all threads to the back of the ready queue
-	while (temp != NULL) {
-		
-		addToReadyTail(temp,s,0);
+	// Add list of joins from current TCB to back of ready queue, each with the exit value
+	while (joiner != NULL) {
+
+		//printf("adding back to ready queue\n");
+		Node * next = joiner->next;
+		joiner->joinVal = slot->exitVal;
+		readyThread(s, joiner);
+		joiner = next;
 
-		temp = condVarMap[s->currCondVarId];
 	}
 
-	// If a thread terminates, this calls pthread exit for it 
-	s->action = 0;
+	// The joiners have what they waited for
+	if (temp->join_list.head != NULL) releaseSlot(s, i);
+
+	// Give the stack back to the pool. We are on the schedular stack so this is safe
+	freeStack(temp->thread_cb->stack);
+
+	// Recycle the node and its TCB
+	slabFree(&s->threadSlab, (ThreadBlock *) temp);
+
+	// Only count it gone once its joiners are runnable, so this can't look like a deadlock
+	__atomic_sub_fetch(&s->numReady, 1, __ATOMIC_SEQ_CST);
+
+	// The last thread has exited
+	if (__atomic_sub_fetch(&s->size, 1, __ATOMIC_SEQ_CST) == 0) exit(0);
 
-	// Change context to current TCB context
-	swapcontext(&s->sched_context,&s->head->thread_cb->thread_context);
+	//printf("Exited thread.\n");
 }
 
-void lock(Schedular *s) {
+// Join current running thread to another thread, setting *value to its exit value. Returns 0, ESRCH if there is
+// no such thread, EINVAL if it is detached or EDEADLK if it is the caller
+int join(Schedular * s, pthread_t id, void ** value) {
 
-	// Get the first node in the queue 
-	Node * temp = mutexVarMap[s->currMutexVarId];
+	Node * self = currentWorker()->current;
 
-	// Add the current thread to the back of the list
-	if (temp == NULL) {
-		mutexVarMap[s->currMutexVarId] = s->head;
-		temp = s->head;
-	} else {
-		while(temp->next != NULL) temp = temp->next;
-		temp->next = s->head;
-		temp = temp->next;
+	// Find the thread we are joing on
+	ThreadSlot * slot = threadSlot(s, id);
+	if (slot == NULL) return ESRCH;
+
+	// Hold the slot's lock so the target can't finish exiting before we are on its join list
+	spinLock(&slot->lock);
+
+	// Never created, or already joined and its slot reused
+	if (slot->state == SLOT_FREE || slot->gen != (unsigned int) (id >> THREAD_SLOT_BITS)) {
+		spinUnlock(&slot->lock);
+		return ESRCH;
+	}
+
+	if (slot->detached) {
+		spinUnlock(&slot->lock);
+		return EINVAL;
 	}
 
-	// Set head of ready queue to current
-	s->head = s->head->next;
+	// The thread has already exited
+	if (slot->state == SLOT_ZOMBIE) {
+		*value = slot->exitVal;
+		releaseSlot(s, slotIndex(id));
+		return 0;
+	}
+
+	Node * temp = slot->node;
 
-	// Check for Deadlock
-	if(s->head==NULL) {
-		//printf("Deadlock achieved!\nExiting now....\n");
-		exit(0);
+	// Joining ourself would never return
+	if (temp == self) {
+		spinUnlock(&slot->lock);
+		return EDEADLK;
 	}
 
-	s->head->prev = NULL;
+	// Add current TCB to back of its joining queue
+	waitQueuePush(&temp->join_list, self);
 
-	// Make the end of the join list NULL
-	temp->next = NULL;
+	//printf("Thread join.\n");
 
-	// If a thread terminates, this calls pthread exit for it 
-	s->action = 0;
+	// Wait for the target to exit. It frees the slot after handing us the exit value
+	blockThread(s, &slot->lock, BLOCK_JOIN);
+	*value = self->joinVal;
+	return 0;
+}
 
-	//printf("Just Locked.\n");
-	printReadyQueue(s);
-	//printf("%d\n",s->head->thread_cb->thread_id);
-	// Change context to current TCB context
-	swapcontext(&s->sched_context,&s->head->thread_cb->thread_context);
+// Mark a thread so it is freed as soon as it exits, or free it now if it has. Returns 0, ESRCH if there is
+// no such thread or EINVAL if it is already detached or being joined
+int detach(Schedular * s, pthread_t id) {
+
+	ThreadSlot * slot = threadSlot(s, id);
+	if (slot == NULL) return ESRCH;
+
+	spinLock(&slot->lock);
+	if (slot->state == SLOT_FREE || slot->gen != (unsigned int) (id >> THREAD_SLOT_BITS)) {
+		spinUnlock(&slot->lock);
+		return ESRCH;
+	}
+
+	if (slot->detached || (slot->state == SLOT_LIVE && slot->node->join_list.head != NULL)) {
+		spinUnlock(&slot->lock);
+		return EINVAL;
+	}
 
+	// Nobody wants its exit value
+	if (slot->state == SLOT_ZOMBIE) {
+		releaseSlot(s, slotIndex(id));
+		return 0;
+	}
+
+	slot->detached = 1;
+	spinUnlock(&slot->lock);
+	return 0;
 }
 
-void unlock(Schedular *s) {
-	// Get the head of the queue
-	//printf("u0: %d\n",s->currMutexVarId);
-	Node * temp = mutexVarMap[s->currMutexVarId];
-	//printf("u1\n");
-	if (temp != NULL) {
-		//printf("u2\n");
-		addToReadyTail(temp,s,1);
+// Change the scheduling policy and priority of a live thread. Returns 0 or ESRCH
+int setThreadSched(Schedular * s, pthread_t id, int policy, int priority) {
+
+	ThreadSlot * slot = threadSlot(s, id);
+	if (slot == NULL) return ESRCH;
+
+	spinLock(&slot->lock);
+	if (slot->state != SLOT_LIVE || slot->gen != (unsigned int) (id >> THREAD_SLOT_BITS)) {
+		spinUnlock(&slot->lock);
+		return ESRCH;
 	}
-	//printf("u3\n");
-	// If a thread terminates, this calls pthread exit for it 
-	s->action = 0;
-	//printf("u4\n");
 
-	//printf("Unlocked.\n");
-	printReadyQueue(s);
+	// A queued thread keeps its place and moves to the new level the next time it is queued
+	setSchedParams(s, slot->node->thread_cb, policy, priority);
+	spinUnlock(&slot->lock);
+	return 0;
+}
+
+// Read the scheduling policy and priority of a live thread. Returns 0 or ESRCH
+int getThreadSched(Schedular * s, pthread_t id, int * policy, int * priority) {
+
+	ThreadSlot * slot = threadSlot(s, id);
+	if (slot == NULL) return ESRCH;
+
+	spinLock(&slot->lock);
+	if (slot->state != SLOT_LIVE || slot->gen != (unsigned int) (id >> THREAD_SLOT_BITS)) {
+		spinUnlock(&slot->lock);
+		return ESRCH;
+	}
 
-	// Change context to current TCB context
-	swapcontext(&s->sched_context,&s->head->thread_cb->thread_context);
+	*policy = slot->node->thread_cb->schedPolicy;
+	*priority = slot->node->thread_cb->schedPriority;
+	spinUnlock(&slot->lock);
+	return 0;
 }
 
-// Adds a node from a cond. var queue to the back of the ready queue
-void addToReadyTail(Node* n,Schedular *s, int isLock) {
+// Add the current thread to the correct conditional variable queue, releasing the mutex.
+// Waits until the monotonic deadline in milliseconds, or for good if it is -1. Returns 0 or ETIMEDOUT
+int waitOnCond (Schedular *s, int id, int mutexId, int * mutexLocked, long deadline) {
 
-	// Add this to the back of the ready queue
-	s->tail->next = n;
-	s->tail->next->prev = s->tail;
-	s->tail = n;
+	SyncObject * c = condObject(id);
+	spinLock(&c->lock);
 
-	// Set the head of the queue to the next value
-	if (isLock) {
-		mutexVarMap[s->currMutexVarId] = n->next;
+	// Give up the mutex. A signal can't get in until we are on the queue
+	unlock(s, mutexId, mutexLocked);
+
+	// A signal moves us onto its queue
+	Node * self = currentWorker()->current;
+	self->condMutex = mutexId;
+	self->condMutexLocked = mutexLocked;
+
+	// Add the current thread to the back of the list and change context to the next runnable thread
+	return parkThread(s, &c->queue, &c->lock, deadline, BLOCK_COND);
+}
+
+// Move n, a cond. var waiter a signal has taken, onto the queue of its mutex rather than waking it only for it
+// to find the mutex held. The unlock that hands the mutex over wakes it. If the mutex is free it is taken
+// for n, which is made runnable owning it. Call with the cond. var's lock held
+void requeueOnMutex(Schedular * s, Node * n) {
+
+	SyncObject * m = mutexObject(n->condMutex);
+	int * locked = n->condMutexLocked;
+	spinLock(&m->lock);
+
+	int v = __atomic_load_n(locked, __ATOMIC_RELAXED);
+	while (1) {
+		if (v == MUTEX_FREE) {
+			if (__atomic_compare_exchange_n(locked, &v, m->queue.head != NULL ? MUTEX_CONTENDED : MUTEX_LOCKED, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				spinUnlock(&m->lock);
+				n->handedOff = 1;
+				readyThread(s, n);
+				return;
+			}
+		} else if (v == MUTEX_CONTENDED || __atomic_compare_exchange_n(locked, &v, MUTEX_CONTENDED, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+
+	// A new wait, so the timer of the cond. var wait can't claim it. There is no timeout on getting the mutex back
+	n->waitState = (n->waitState & ~WAIT_STATE_MASK) + (1 << 2) + WAIT_WAITING;
+	n->waitLock = &m->lock;
+	n->waitQueue = &m->queue;
+	waitQueuePush(&m->queue, n);
+	spinUnlock(&m->lock);
+}
+
+// Take the head of the cond. var queue and move it to its mutex
+void sig(Schedular *s, int id) {
+
+	SyncObject * c = condObject(id);
+	spinLock(&c->lock);
+
+	Node * n = takeWaiter(&c->queue);
+	if (n != NULL) requeueOnMutex(s, n);
+
+	spinUnlock(&c->lock);
+
+	// The caller keeps running, so there is nothing to switch to
+}
+
+// Move all threads waiting on the cond. variable to their mutex. Each wakes once, when it is its turn to own it
+void broadcast (Schedular *s, int id) {
+
+	SyncObject * c = condObject(id);
+	spinLock(&c->lock);
+
+	Node * n;
+	while ((n = takeWaiter(&c->queue)) != NULL) requeueOnMutex(s, n);
+
+	spinUnlock(&c->lock);
+}
+
+// Wait until the mutex is free and take it. The caller has already failed to take it without waiting.
+// Gives up at the monotonic deadline in milliseconds, or never if it is -1. Returns 0 or ETIMEDOUT
+int lock(Schedular *s, int id, int * locked, long deadline) {
+
+	Node * self = currentWorker()->current;
+	SyncObject * m = mutexObject(id);
+
+	spinLock(&m->lock);
+
+	// Marking it contended first means the holder's unlock will look at the queue
+	while (__atomic_exchange_n(locked, MUTEX_CONTENDED, __ATOMIC_ACQUIRE) != MUTEX_FREE) {
+
+		// Add the current thread to the back of the list
+		//printf("Just Locked.\n");
+		if (parkThread(s, &m->queue, &m->lock, deadline, BLOCK_MUTEX) == ETIMEDOUT) return ETIMEDOUT;
+
+		// With handoff the unlocking thread made us the owner
+		if (self->handedOff) {
+			self->handedOff = 0;
+			return 0;
+		}
+
+		// Barging. Another thread may have taken the mutex first, so try again
+		spinLock(&m->lock);
+	}
+
+	// Nobody else can queue while we hold the queue lock, so an empty queue means no waiters
+	if (m->queue.head == NULL) __atomic_store_n(locked, MUTEX_LOCKED, __ATOMIC_RELAXED);
+	spinUnlock(&m->lock);
+	return 0;
+}
+
+// Free the mutex and wake the first thread waiting for it
+void unlock(Schedular *s, int id, int * locked) {
+
+	// Nobody is waiting
+	int expected = MUTEX_LOCKED;
+	if (__atomic_compare_exchange_n(locked, &expected, MUTEX_FREE, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) return;
+
+	SyncObject * m = mutexObject(id);
+	spinLock(&m->lock);
+
+	// Get the head of the queue, skipping waiters that have timed out
+	//printf("u0: %d\n",id);
+	Node * temp = s->mutexPolicy == ULT_MUTEX_HANDOFF ? takeWaiter(&m->queue) : m->queue.head;
+	//printf("u1\n");
+	if (temp == NULL) {
+		__atomic_store_n(locked, MUTEX_FREE, __ATOMIC_RELEASE);
+	} else if (s->mutexPolicy == ULT_MUTEX_HANDOFF) {
+		// The first waiter owns the mutex as soon as it runs, so nobody can take it in between
+		temp->handedOff = 1;
+		__atomic_store_n(locked, m->queue.head != NULL ? MUTEX_CONTENDED : MUTEX_LOCKED, __ATOMIC_RELAXED);
+		readyThread(s, temp);
 	} else {
-		condVarMap[s->currCondVarId] = n->next;
+		// Free it now and let the first waiter compete for it with running threads
+		__atomic_store_n(locked, MUTEX_FREE, __ATOMIC_RELEASE);
+		//printf("u2\n");
+		addToReadyTail(s, &m->queue);
 	}
 
-	// End of the list points to NULL
-	s->tail->next = NULL;
+	spinUnlock(&m->lock);
+
+	//printf("Unlocked.\n");
+}
+
+// Moves the first node of a mutex queue that has not timed out to the back of the ready queue
+void addToReadyTail(Schedular *s, WaitQueue * queue) {
+
+	// Set the head of the queue to the next value
+	Node * n = takeWaiter(queue);
+
+	if (n != NULL) readyThread(s, n);
 }
 
+// Walk the calling worker's run queue
 void printReadyQueue(Schedular *s) {
 
-	Node * temp = s->head;
+	Worker * w = currentWorker();
+	unsigned int i;
+	int level;
 	//printf("Printing Queue:\n");
-	while (temp!=NULL) {
-		//printf("%d\n",temp->thread_cb->thread_id);
-		temp = temp->next;
+	for (level = 0; level < NUM_LEVELS; level++) {
+		for (i = w->runq[level].head; i != w->runq[level].tail; i++) {
+			//printf("%d: %d\n",level,w->runq[level].slots[i % RUN_QUEUE_SIZE]->thread_cb->thread_id);
+		}
 	}
 	//printf("NULL\n");
 
@@ -492,5 +1440,5 @@ int canCreateThread(Schedular * s) {
 // Does the schedular have any threads to run
 int isEmpty(Schedular * s) {
   //fprintf(stdout,"isJobAvailable\n");
-  return(s->head == NULL);
+  return(s->size == 0);
 }
@@ -0,0 +1,218 @@
+/**
+ * semaphore.c
+ *
+ * This file contains sem_t
+ *
+ * The sem_t holds the value, a bit saying threads may be waiting, and the id
+ * of its wait queue in the semaphore table. Waiting while the value is above
+ * 0 and posting while nobody waits are a single CAS with no schedular call.
+ * Posting to a semaphore with waiters hands the unit straight to the first of
+ * them instead of raising the value, so it can't be taken in between.
+ *
+ * Only semaphores shared between the threads of one process are supported.
+ */
+#include <semaphore.h>
+#include <limits.h>
+
+// Value word bits
+#define SEM_WAITERS 0x80000000u // Threads may be on the queue. Posts take the slow path
+#define SEM_VALUE 0x7fffffffu
+
+
+// Our layout of a sem_t
+typedef struct SemWord {
+	volatile unsigned int value; // SEM_VALUE bits and SEM_WAITERS
+	int id; // Its queue in the semaphore table
+} SemWord;
+
+// Table(map) of the semaphore queues. Its entries are SyncObjects
+IdTable semTable;
+
+
+// The value word of a semaphore
+SemWord * semWord(sem_t * sem) {
+	return (SemWord *) sem;
+}
+
+// Wait for a unit of the semaphore. The caller has found its value at 0. Gives up at the monotonic deadline
+// in milliseconds, or never if it is -1. Returns 0 or ETIMEDOUT
+int semWait(Schedular * s, int id, volatile unsigned int * value, long deadline) {
+
+	SyncObject * o = (SyncObject *) idEntry(&semTable, id);
+	spinLock(&o->lock);
+
+	unsigned int v = __atomic_load_n(value, __ATOMIC_RELAXED);
+	while (1) {
+
+		// Posted since we looked
+		if ((v & SEM_VALUE) > 0) {
+			if (__atomic_compare_exchange_n(value, &v, v - 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				spinUnlock(&o->lock);
+				return 0;
+			}
+			continue;
+		}
+
+		// Marking it first means the next post will look at the queue
+		if (__atomic_compare_exchange_n(value, &v, v | SEM_WAITERS, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+	}
+
+	// The posting thread hands us its unit before it wakes us
+	return parkThread(s, &o->queue, &o->lock, deadline, BLOCK_COND);
+}
+
+// Post to a semaphore that may have waiters. Returns 0 or EOVERFLOW
+int semPost(Schedular * s, int id, volatile unsigned int * value) {
+
+	SyncObject * o = (SyncObject *) idEntry(&semTable, id);
+	spinLock(&o->lock);
+
+	// Give the unit to the first waiter. The value stays at 0 while anyone waits
+	Node * n = takeWaiter(&o->queue);
+	if (n != NULL) {
+		if (o->queue.head == NULL) __atomic_and_fetch(value, ~SEM_WAITERS, __ATOMIC_RELEASE);
+		readyThread(s, n);
+		spinUnlock(&o->lock);
+		return 0;
+	}
+
+	// The waiters have all timed out. Clear the mark while raising the value
+	unsigned int v = __atomic_load_n(value, __ATOMIC_RELAXED);
+	do {
+		if ((v & SEM_VALUE) == SEM_VALUE_MAX) {
+			spinUnlock(&o->lock);
+			return EOVERFLOW;
+		}
+	} while (!__atomic_compare_exchange_n(value, &v, (v & SEM_VALUE) + 1, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	spinUnlock(&o->lock);
+	return 0;
+}
+
+
+/************************ SEMAPHORES ****************************/
+
+
+// Initialize a semaphore with value units. Returns 0, or -1 with errno EINVAL, ENOSYS for one shared between processes, or ENOMEM
+int sem_init(sem_t * sem, int pshared, unsigned int value) {
+
+	if (value > SEM_VALUE_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	// Green threads can't wait on memory shared with other processes
+	if (pshared != 0) {
+		errno = ENOSYS;
+		return -1;
+	}
+
+	if (schedularCreated == 0) initSchedular();
+
+	int id = idAlloc(&semTable);
+	if (id == -1) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	SemWord * w = semWord(sem);
+	w->value = value;
+	w->id = id;
+	return 0;
+}
+
+// Destroy the semaphore, giving its id back. Returns 0, or -1 with errno EBUSY while threads wait on it
+int sem_destroy(sem_t * sem) {
+
+	SemWord * w = semWord(sem);
+
+	preemptDisable();
+	SyncObject * o = (SyncObject *) idEntry(&semTable, w->id);
+	spinLock(&o->lock);
+	if (o->queue.head != NULL) {
+		spinUnlock(&o->lock);
+		preemptEnable();
+		errno = EBUSY;
+		return -1;
+	}
+	spinUnlock(&o->lock);
+
+	idFree(&semTable, w->id);
+	w->id = 0;
+	preemptEnable();
+	return 0;
+}
+
+// Take a unit, waiting until the monotonic deadline in milliseconds (-1 for good, 0 not at all). Returns 0 or an errno value
+int semTake(sem_t * sem, long deadline) {
+
+	// Above 0. A single CAS, so preemption can stay on
+	SemWord * w = semWord(sem);
+	unsigned int v = __atomic_load_n(&w->value, __ATOMIC_RELAXED);
+	while ((v & SEM_VALUE) > 0) {
+		if (__atomic_compare_exchange_n(&w->value, &v, v - 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return 0;
+	}
+
+	if (deadline == 0) return EAGAIN;
+
+	preemptDisable();
+	int err = semWait(schedular, w->id, &w->value, deadline);
+	preemptEnable();
+	return err;
+}
+
+// Take a unit, waiting while there are none
+int sem_wait(sem_t * sem) {
+	return semTake(sem, -1);
+}
+
+// Take a unit only if there is one. Returns 0, or -1 with errno EAGAIN
+int sem_trywait(sem_t * sem) {
+	int err = semTake(sem, 0);
+	if (err == 0) return 0;
+	errno = err;
+	return -1;
+}
+
+// Take a unit, giving up once the CLOCK_REALTIME time abstime has passed. Returns 0, or -1 with errno ETIMEDOUT or EINVAL
+int sem_timedwait(sem_t * sem, const struct timespec * abstime) {
+
+	if (abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000L) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	int err = semTake(sem, realtimeDeadline(abstime));
+	if (err == 0) return 0;
+	errno = err;
+	return -1;
+}
+
+// Give a unit back, waking the first waiter if there is one. Returns 0, or -1 with errno EOVERFLOW
+int sem_post(sem_t * sem) {
+
+	// Nobody waits
+	SemWord * w = semWord(sem);
+	unsigned int v = __atomic_load_n(&w->value, __ATOMIC_RELAXED);
+	while ((v & SEM_WAITERS) == 0) {
+		if (v == SEM_VALUE_MAX) {
+			errno = EOVERFLOW;
+			return -1;
+		}
+		if (__atomic_compare_exchange_n(&w->value, &v, v + 1, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) return 0;
+	}
+
+	preemptDisable();
+	int err = semPost(schedular, w->id, &w->value);
+	preemptEnable();
+
+	if (err == 0) return 0;
+	errno = err;
+	return -1;
+}
+
+// Read the value. It is 0 while threads wait
+int sem_getvalue(sem_t * sem, int * sval) {
+	*sval = semWord(sem)->value & SEM_VALUE;
+	return 0;
+}
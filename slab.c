@@ -0,0 +1,82 @@
+/**
+ * slab.c
+ *
+ * This file contains the fixed size object allocator used for thread blocks
+ *
+ * Objects are carved out of mmap'd chunks and recycled through a free list, so
+ * in steady state allocating and freeing never calls malloc, which is not safe
+ * to enter again when the timer preempts a thread inside it.
+ *
+ * Uses SpinLock from spinlock.c
+ */
+#include <sys/mman.h>
+
+// Constants
+#define CACHE_LINE_SIZE 64
+#define SLAB_CHUNK_SIZE 65536 // Bytes mapped at a time when the free list runs out
+
+
+// A pool of objects of one size
+typedef struct Slab {
+	SpinLock lock; // Guards the free list
+	size_t objSize; // Rounded up to whole cache lines so objects never share one
+	void * freeList; // Free objects, linked through their first word
+	size_t numFree;
+	size_t numChunks;
+} Slab;
+
+
+// Set up an empty pool of objects of the given size
+void slabInit(Slab * slab, size_t size) {
+	slab->lock.locked = 0;
+	slab->objSize = (size + CACHE_LINE_SIZE - 1) & ~(size_t) (CACHE_LINE_SIZE - 1);
+	slab->freeList = NULL;
+	slab->numFree = 0;
+	slab->numChunks = 0;
+}
+
+// Get an object. Returns NULL if a new chunk was needed and could not be mapped
+void * slabAlloc(Slab * slab) {
+
+	spinLock(&slab->lock);
+
+	// Refill the free list with a new chunk. mmap returns page aligned memory so objects stay cache line aligned
+	if (slab->freeList == NULL) {
+		size_t chunkSize = slab->objSize > SLAB_CHUNK_SIZE ? slab->objSize : SLAB_CHUNK_SIZE;
+		char * chunk = mmap(NULL, chunkSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (chunk == MAP_FAILED) {
+			spinUnlock(&slab->lock);
+			return NULL;
+		}
+
+		// Link them in address order so the first allocations are next to each other
+		size_t n = chunkSize / slab->objSize;
+		size_t i;
+		for (i = 0; i < n; i++) {
+			*(void **) (chunk + i * slab->objSize) = i + 1 < n ? chunk + (i + 1) * slab->objSize : NULL;
+		}
+		slab->freeList = chunk;
+		slab->numFree += n;
+		slab->numChunks++;
+	}
+
+	void * obj = slab->freeList;
+	slab->freeList = *(void **) obj;
+	slab->numFree--;
+
+	spinUnlock(&slab->lock);
+
+	return obj;
+}
+
+// Return an object to its pool. Chunks are kept for reuse, never unmapped
+void slabFree(Slab * slab, void * obj) {
+
+	if (obj == NULL) return;
+
+	spinLock(&slab->lock);
+	*(void **) obj = slab->freeList;
+	slab->freeList = obj;
+	slab->numFree++;
+	spinUnlock(&slab->lock);
+}
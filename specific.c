@@ -0,0 +1,192 @@
+/**
+ * specific.c
+ *
+ * This file contains pthread_key_t, the thread specific data
+ *
+ * Every green thread runs on the same few kernel threads, so __thread
+ * variables are shared between them. Keys give each green thread its own
+ * values instead. The values of the first NUM_INLINE_KEYS keys are kept in
+ * the TCB and the running thread's are reached through currSpecific, which
+ * afterSwitch points at them, so pthread_getspecific is two loads. Higher keys
+ * go in an array the thread grows when it first sets one of them.
+ *
+ * Deleting a key clears its value in every live thread, so a key made later
+ * with the same number starts out NULL everywhere.
+ */
+#include <limits.h>
+
+
+// Entry of the key table. The key is its id
+typedef struct KeyObject {
+	int nextFree; // Link on the table's free list
+	int live; // Created and not yet deleted
+	void (*destructor)(void *); // Called on a thread's value when it exits, or NULL
+} KeyObject;
+
+// Table(map) of the keys
+IdTable keyTable;
+
+
+// The key object of a key that exists, or NULL
+KeyObject * keyObject(pthread_key_t key) {
+	if (key > INT_MAX) return NULL;
+	KeyObject * k = (KeyObject *) idLookup(&keyTable, (int) key);
+	if (k == NULL || !k->live) return NULL;
+	return k;
+}
+
+// Where thread t keeps its value of key, or NULL if it has no room for it yet
+void ** specificSlot(TCB * t, pthread_key_t key) {
+	if (key < NUM_INLINE_KEYS) return &t->specific[key];
+	if (key - NUM_INLINE_KEYS < (pthread_key_t) t->numOverflow) return &t->specificOverflow[key - NUM_INLINE_KEYS];
+	return NULL;
+}
+
+// Give thread t a new overflow array of n entries, copying its values over, and return the old one to free.
+// Done under its slot's lock so clearSpecific never writes to an array that has been freed
+void ** replaceOverflow(TCB * t, void ** array, int n) {
+
+	ThreadSlot * slot = (ThreadSlot *) idEntry(&threadTable, slotIndex(t->thread_id));
+	spinLock(&slot->lock);
+	void ** old = t->specificOverflow;
+	if (array != NULL && old != NULL) memcpy(array, old, t->numOverflow * sizeof(void *));
+	t->specificOverflow = array;
+	t->numOverflow = n;
+	spinUnlock(&slot->lock);
+
+	return old;
+}
+
+// Clear the value of key in every live thread. Call with preemption disabled
+void clearSpecific(pthread_key_t key) {
+
+	int i;
+	int end = __atomic_load_n(&threadTable.nextUnused, __ATOMIC_ACQUIRE);
+	for (i = 1; i < end; i++) {
+		ThreadSlot * slot = (ThreadSlot *) idEntry(&threadTable, i);
+		spinLock(&slot->lock);
+		if (slot->state == SLOT_LIVE) {
+			void ** value = specificSlot(slot->node->thread_cb, key);
+			if (value != NULL) *value = NULL;
+		}
+		spinUnlock(&slot->lock);
+	}
+}
+
+// Call the destructors of the calling thread's values as it exits, then free its overflow array.
+// Destructors may set values again, so go round up to PTHREAD_DESTRUCTOR_ITERATIONS times
+void runKeyDestructors(void) {
+
+	preemptDisable();
+	TCB * t = currentWorker()->current->thread_cb;
+	preemptEnable();
+
+	int round;
+	int ran = 1;
+	for (round = 0; round < PTHREAD_DESTRUCTOR_ITERATIONS && ran; round++) {
+		ran = 0;
+
+		// A destructor may grow the overflow array, so the slot is looked up each time
+		pthread_key_t key;
+		for (key = 0; key < (pthread_key_t) (NUM_INLINE_KEYS + t->numOverflow); key++) {
+			void ** slot = specificSlot(t, key);
+			void * value = *slot;
+			if (value == NULL) continue;
+			*slot = NULL;
+
+			KeyObject * k = keyObject(key);
+			if (k != NULL && k->destructor != NULL) {
+				k->destructor(value);
+				ran = 1;
+			}
+		}
+	}
+
+	// Inside a critical section so a thread preempted in malloc can't be entered again on this worker
+	preemptDisable();
+	free(replaceOverflow(t, NULL, 0));
+	preemptEnable();
+}
+
+
+/************************ THREAD SPECIFIC DATA ****************************/
+
+
+// Make a new key. Every thread's value of it starts NULL. Returns 0 or EAGAIN
+int pthread_key_create(pthread_key_t * key, void (*destructor)(void *)) {
+
+	if (schedularCreated == 0) initSchedular();
+
+	int id = idAlloc(&keyTable);
+	if (id == -1) return EAGAIN;
+
+	KeyObject * k = (KeyObject *) idEntry(&keyTable, id);
+	k->destructor = destructor;
+	__atomic_store_n(&k->live, 1, __ATOMIC_RELEASE);
+
+	*key = id;
+	return 0;
+}
+
+// Delete a key. Destructors aren't called, and its values are dropped. Returns 0 or EINVAL
+int pthread_key_delete(pthread_key_t key) {
+
+	preemptDisable();
+	KeyObject * k = keyObject(key);
+	if (k == NULL) {
+		preemptEnable();
+		return EINVAL;
+	}
+
+	k->live = 0;
+	clearSpecific(key);
+	idFree(&keyTable, (int) key);
+	preemptEnable();
+	return 0;
+}
+
+// The calling thread's value of key, NULL if it has not set one
+void * pthread_getspecific(pthread_key_t key) {
+
+	// Inline. currSpecific is read in one load, so this is right whichever worker we are on
+	if (key < NUM_INLINE_KEYS) return currSpecific[key];
+
+	preemptDisable();
+	void ** slot = specificSlot(currentWorker()->current->thread_cb, key);
+	void * value = slot != NULL ? *slot : NULL;
+	preemptEnable();
+	return value;
+}
+
+// Set the calling thread's value of key. Returns 0, EINVAL for a key that doesn't exist, or ENOMEM
+int pthread_setspecific(pthread_key_t key, const void * value) {
+
+	if (keyObject(key) == NULL) return EINVAL;
+
+	if (key < NUM_INLINE_KEYS) {
+		currSpecific[key] = (void *) value;
+		return 0;
+	}
+
+	preemptDisable();
+	TCB * t = currentWorker()->current->thread_cb;
+	void ** slot = specificSlot(t, key);
+
+	// Grow the overflow array to hold the key, at least doubling it
+	if (slot == NULL) {
+		int n = t->numOverflow * 2;
+		if (n < (int) (key - NUM_INLINE_KEYS + 1)) n = key - NUM_INLINE_KEYS + 1;
+
+		void ** grown = (void **) calloc(n, sizeof(void *));
+		if (grown == NULL) {
+			preemptEnable();
+			return ENOMEM;
+		}
+		free(replaceOverflow(t, grown, n));
+		slot = specificSlot(t, key);
+	}
+
+	*slot = (void *) value;
+	preemptEnable();
+	return 0;
+}
@@ -0,0 +1,54 @@
+/**
+ * spinlock.c
+ *
+ * This file contains the spin lock that guards schedular state shared between workers
+ *
+ * Locks are only ever held with preemption disabled, so the holder is never a
+ * green thread that has been switched out and the wait is always short.
+ */
+#include <sched.h>
+
+// Spins before giving the kernel thread's time slice away
+#define SPIN_LIMIT 100
+
+
+typedef struct SpinLock {
+	volatile int locked;
+} SpinLock;
+
+
+// Tell the CPU we are in a spin loop
+void cpuRelax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__asm__ volatile("pause" ::: "memory");
+#elif defined(__aarch64__)
+	__asm__ volatile("yield" ::: "memory");
+#else
+	__asm__ volatile("" ::: "memory");
+#endif
+}
+
+// Take the lock
+void spinLock(SpinLock * l) {
+	int spins = 0;
+	while (__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(&l->locked, __ATOMIC_RELAXED)) {
+			// The holder's kernel thread may have been descheduled
+			if (++spins == SPIN_LIMIT) {
+				sched_yield();
+				spins = 0;
+			}
+			cpuRelax();
+		}
+	}
+}
+
+// Take the lock if it is free. Returns 1 on success
+int spinTryLock(SpinLock * l) {
+	return !__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE);
+}
+
+// Release the lock
+void spinUnlock(SpinLock * l) {
+	__atomic_store_n(&l->locked, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,140 @@
+/**
+ * stack.c
+ *
+ * This file contains the implementation of the thread stack pool
+ *
+ * Stacks are mapped with MAP_NORESERVE, so a large one only costs the pages
+ * its thread has touched. With trimming on, the pages below the stack pointer
+ * of a thread that has been blocked a while, and the used pages of stacks
+ * going back to the pool, are given back with madvise(MADV_DONTNEED).
+ *
+ * Uses SpinLock from spinlock.c
+ */
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Constants
+#define DEFAULT_STACK_SIZE 65536
+#define NUM_STACK_CLASSES 48 // One free list per power of two mapping size
+#define MAX_FREE_STACKS 64 // Stacks kept per class before they are unmapped
+
+
+// A thread stack. The descriptor sits at the top of its own mapping, above the usable stack
+typedef struct Stack {
+	char * base; // Lowest address of the mapping (the guard page, if any)
+	size_t mapSize; // Size of the whole mapping
+	size_t guardSize; // Size of the inaccessible region at the bottom
+	size_t size; // Usable bytes between the guard and the descriptor
+	struct Stack * next; // Next stack on the free list
+} Stack;
+
+
+// Free lists of stacks whose threads have exited, indexed by size class
+// Trade off: freed stacks stay mapped so the next create does not need a syscall
+Stack * freeStacks[NUM_STACK_CLASSES];
+int numFreeStacks[NUM_STACK_CLASSES];
+SpinLock stackLock; // Guards the free lists
+
+// Cached page size
+size_t pageSize = 0;
+
+// Settings from ult_set_stack_reserve and ult_set_stack_trim
+size_t defaultStackSize = DEFAULT_STACK_SIZE; // Stack of threads created without a stack size of their own
+long stackTrimMs = 0; // Time a thread has to be blocked for before its stack is trimmed, 0 for never
+
+
+// Round a size up to a whole number of pages
+size_t pageRound(size_t size) {
+	if (pageSize == 0) pageSize = sysconf(_SC_PAGESIZE);
+	return (size + pageSize - 1) & ~(pageSize - 1);
+}
+
+// The size class of a mapping is the log2 of its size rounded up to a power of two
+int stackClass(size_t mapSize) {
+	int c = 0;
+	while (((size_t) 1 << c) < mapSize) c++;
+	return c;
+}
+
+// Get a stack with at least size usable bytes and a guard of guardSize bytes below it
+Stack * allocStack(size_t size, size_t guardSize) {
+
+	guardSize = pageRound(guardSize);
+
+	// Round the mapping up to its class so any stack on the free list fits
+	int c = stackClass(guardSize + pageRound(size + sizeof(Stack)));
+	if (c >= NUM_STACK_CLASSES) return NULL;
+	size_t mapSize = (size_t) 1 << c;
+
+	// Reuse a freed stack of the same class and guard size if there is one
+	spinLock(&stackLock);
+	Stack ** prev = &freeStacks[c];
+	while (*prev != NULL) {
+		Stack * temp = *prev;
+		if (temp->guardSize == guardSize) {
+			*prev = temp->next;
+			numFreeStacks[c]--;
+			spinUnlock(&stackLock);
+			return temp;
+		}
+		prev = &temp->next;
+	}
+	spinUnlock(&stackLock);
+
+	// Otherwise map a new one. Pages are only committed when the thread touches them
+	char * base = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED) return NULL;
+
+	// Make the bottom of the stack inaccessible so an overflow faults instead of corrupting memory
+	if (guardSize > 0 && mprotect(base, guardSize, PROT_NONE) != 0) {
+		munmap(base, mapSize);
+		return NULL;
+	}
+
+	Stack * stack = (Stack *) (base + mapSize - sizeof(Stack));
+	stack->base = base;
+	stack->mapSize = mapSize;
+	stack->guardSize = guardSize;
+	stack->size = mapSize - guardSize - sizeof(Stack);
+	stack->next = NULL;
+
+	return stack;
+}
+
+// Lowest usable address of a stack
+void * stackBottom(Stack * stack) {
+	return stack->base + stack->guardSize;
+}
+
+// Give back the pages of a stack wholly below addr. They read as zeros if they are touched again
+void trimStack(Stack * stack, char * addr) {
+	char * bottom = (char *) stackBottom(stack);
+	char * end = (char *) ((uintptr_t) addr & ~(uintptr_t) (pageSize - 1));
+	if (end > bottom) madvise(bottom, end - bottom, MADV_DONTNEED);
+}
+
+// Return a stack to the pool once its thread will never run on it again
+void freeStack(Stack * stack) {
+
+	if (stack == NULL) return;
+
+	// Keep only the descriptor's page while it waits for another thread
+	if (stackTrimMs > 0) trimStack(stack, (char *) stack);
+
+	int c = stackClass(stack->mapSize);
+
+	spinLock(&stackLock);
+
+	// Unmap it if the pool for this class is already full
+	if (numFreeStacks[c] >= MAX_FREE_STACKS) {
+		spinUnlock(&stackLock);
+		munmap(stack->base, stack->mapSize);
+		return;
+	}
+
+	stack->next = freeStacks[c];
+	freeStacks[c] = stack;
+	numFreeStacks[c]++;
+
+	spinUnlock(&stackLock);
+}
@@ -0,0 +1,182 @@
+/**
+ * stress.c
+ *
+ * This file contains the scalability stress run by make stress
+ *
+ * For each thread count given on the command line it creates that many
+ * threads, has every thread yield a few times and joins them all, then prints
+ * one CSV line: create and join latency percentiles, resident memory per live
+ * thread and the time one pass of the schedular takes per thread. Run it with
+ * growing counts to get curves.
+ *
+ * Preemption is off unless -q gives a quantum, so the threads only switch
+ * when they yield.
+ *
+ * Usage: stress [-y yields] [-s stack bytes] [-q quantum usec] count...
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "ult.h"
+
+// Constants
+#define DEFAULT_YIELDS 3 // Yields per thread before it exits
+#define DEFAULT_STRESS_STACK 16384 // Small stacks and no guard pages so a million threads fit
+
+// Declared by pthread.h only with _GNU_SOURCE
+int pthread_yield(void);
+
+
+// Yields each thread makes
+int yields = DEFAULT_YIELDS;
+
+// Passes made by all threads together. A thread counts itself before each yield
+volatile long progress;
+
+
+// Monotonic time in nanoseconds
+long nowNs(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+// Resident set size of the process in kilobytes
+long rssKb(void) {
+	long pages = 0;
+	FILE * f = fopen("/proc/self/statm", "r");
+	if (f == NULL) return 0;
+	if (fscanf(f, "%*s %ld", &pages) != 1) pages = 0;
+	fclose(f);
+	return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Sort helper for the percentiles
+int compareLong(const void * a, const void * b) {
+	long x = *(const long *) a;
+	long y = *(const long *) b;
+	return (x > y) - (x < y);
+}
+
+// The pth percentile of n sorted values
+long percentile(long * sorted, int n, int p) {
+	if (n == 0) return 0;
+	return sorted[(long) (n - 1) * p / 100];
+}
+
+// Body of every stress thread
+void * yielder(void * arg) {
+	int i;
+	for (i = 0; i < yields; i++) {
+		__atomic_add_fetch(&progress, 1, __ATOMIC_RELAXED);
+		pthread_yield();
+	}
+	return NULL;
+}
+
+
+// Create, run and join count threads and print their CSV line
+void stress(int count, pthread_attr_t * attr) {
+
+	pthread_t * threads = malloc(count * sizeof(pthread_t));
+	long * createNs = malloc(count * sizeof(long));
+	long * joinNs = malloc(count * sizeof(long));
+	if (threads == NULL || createNs == NULL || joinNs == NULL) {
+		fprintf(stderr, "stress: out of memory for %d threads\n", count);
+		exit(1);
+	}
+
+	long start = nowNs();
+	long rssBefore = rssKb();
+
+	// Creating. The new threads don't run until we yield, so the run queue grows to count
+	int created;
+	for (created = 0; created < count; created++) {
+		long t = nowNs();
+		if (pthread_create(&threads[created], attr, yielder, NULL) != 0) break;
+		createNs[created] = nowNs() - t;
+	}
+	long rssCreated = rssKb();
+
+	// Time how long it takes every thread to get round to its next yield. The first pass also touches every stack
+	progress = 0;
+	long firstPass = 0;
+	long lastPass = 0;
+	long rssRun = 0;
+	int i;
+	for (i = 0; i < yields; i++) {
+		long t = nowNs();
+		while (progress < (long) (i + 1) * created) pthread_yield();
+		lastPass = nowNs() - t;
+		if (i == 0) {
+			firstPass = lastPass;
+			rssRun = rssKb();
+		}
+	}
+
+	for (i = 0; i < created; i++) {
+		long t = nowNs();
+		pthread_join(threads[i], NULL);
+		joinNs[i] = nowNs() - t;
+	}
+
+	long totalMs = (nowNs() - start) / 1000000;
+
+	qsort(createNs, created, sizeof(long), compareLong);
+	qsort(joinNs, created, sizeof(long), compareLong);
+
+	int n = created > 0 ? created : 1;
+	printf("%d,%d,%ld,%ld,%ld,%ld,%.2f,%.2f,%.1f,%.1f,%ld,%ld,%ld,%ld,%ld\n",
+		count, created,
+		percentile(createNs, created, 50), percentile(createNs, created, 90), percentile(createNs, created, 99), percentile(createNs, created, 100),
+		(double) (rssCreated - rssBefore) / n, (double) (rssRun - rssBefore) / n,
+		(double) firstPass / n, (double) lastPass / n,
+		percentile(joinNs, created, 50), percentile(joinNs, created, 90), percentile(joinNs, created, 99), percentile(joinNs, created, 100),
+		totalMs);
+	fflush(stdout);
+
+	free(threads);
+	free(createNs);
+	free(joinNs);
+}
+
+
+int main(int argc, char ** argv) {
+
+	size_t stackSize = DEFAULT_STRESS_STACK;
+	long quantum = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "y:s:q:")) != -1) {
+		if (opt == 'y') yields = atoi(optarg);
+		else if (opt == 's') stackSize = strtoul(optarg, NULL, 0);
+		else if (opt == 'q') quantum = atol(optarg);
+		else {
+			fprintf(stderr, "usage: %s [-y yields] [-s stack bytes] [-q quantum usec] count...\n", argv[0]);
+			return 2;
+		}
+	}
+
+	ult_set_quantum(quantum, ULT_TIMER_REAL);
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, stackSize);
+	pthread_attr_setguardsize(&attr, 0);
+
+	printf("threads,created,create_p50_ns,create_p90_ns,create_p99_ns,create_max_ns,"
+		"rss_kb_per_thread_created,rss_kb_per_thread_run,pass_ns_per_thread_first,pass_ns_per_thread_last,"
+		"join_p50_ns,join_p90_ns,join_p99_ns,join_max_ns,total_ms\n");
+
+	if (optind == argc) {
+		stress(1000, &attr);
+		stress(10000, &attr);
+		stress(100000, &attr);
+	}
+	for (; optind < argc; optind++) stress(atoi(argv[optind]), &attr);
+
+	return 0;
+}
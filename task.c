@@ -0,0 +1,341 @@
+/**
+ * task.c
+ *
+ * This file contains the task pool behind ult_task_submit, ult_future_get and ult_task_group_wait
+ *
+ * A task is a function and its argument in a slab allocated descriptor. Tasks
+ * are queued on the pool and run to completion, one after another, by runner
+ * threads, ordinary green threads that borrow their pooled stacks to whatever
+ * task they take next. A runner only switches when it runs out of tasks, so a
+ * task that doesn't block costs its descriptor and no switch of its own.
+ *
+ * A task that blocks keeps its runner's stack and TCB until it finishes. When
+ * one does, blockThread tells the pool, which wakes an idle runner or has a
+ * new one made once the blocked runner is switched out, so the queued tasks
+ * keep going. Up to one runner per worker runs
+ * tasks at a time; idle runners wait on the pool for more.
+ *
+ * Futures and groups only get a wait queue, from the future and group tables,
+ * once a thread has to wait for them.
+ */
+
+// Constants
+#define FUTURE_DONE -1 // ult_future.id once the task has finished
+#define GROUP_PENDING 0xffffffffUL // Bits of ult_task_group.state counting pending tasks
+#define GROUP_ID_SHIFT 32 // The group's queue id is above them, so the last task sees it in the same atomic op
+
+
+// A queued task
+typedef struct Task {
+	struct Task * next;
+	void * (*fn)(void *);
+	void * arg;
+	ult_future_t * future;
+	ult_task_group_t * group;
+} Task;
+
+// The tasks waiting to run and the runner threads
+typedef struct TaskPool {
+	SpinLock lock; // Guards the rest
+	Task * head; // Queued tasks, oldest first
+	Task * tail;
+	WaitQueue idle; // Runners with nothing to do
+	int numRunners; // Runner threads made so far. They never exit
+	int numAwake; // Runners neither idle nor blocked in a task
+	Slab taskSlab; // Task descriptors
+} TaskPool;
+
+TaskPool taskPool;
+
+// Tables(maps) of the wait queues of futures and groups. Their entries are SyncObjects
+IdTable futureTable;
+IdTable groupTable;
+
+
+// Set up the empty pool
+void makeTaskPool(void) {
+	slabInit(&taskPool.taskSlab, sizeof(Task));
+	idTableInit(&futureTable, sizeof(SyncObject), 1);
+	idTableInit(&groupTable, sizeof(SyncObject), 1);
+}
+
+void * taskRunner(void * arg);
+
+// Get a runner going for the queued tasks. An idle one is made runnable, otherwise a new one is counted.
+// Call with the pool's lock held, which is dropped. Returns 1 if the caller has to make it with spawnRunner
+int claimRunner(Schedular * s) {
+
+	taskPool.numAwake++;
+	Node * n = waitQueuePop(&taskPool.idle);
+	if (n != NULL) {
+		spinUnlock(&taskPool.lock);
+		readyThread(s, n);
+		return 0;
+	}
+
+	taskPool.numRunners++;
+	spinUnlock(&taskPool.lock);
+	return 1;
+}
+
+// Make the runner claimRunner counted. Returns 0, or an errno value if it couldn't be made
+int spawnRunner(Schedular * s) {
+
+	pthread_t runner;
+	int err = pthread_create(&runner, NULL, taskRunner, NULL);
+	if (err != 0) {
+		spinLock(&taskPool.lock);
+		taskPool.numRunners--;
+		taskPool.numAwake--;
+		spinUnlock(&taskPool.lock);
+	}
+	return err;
+}
+
+// Get a runner going for the queued tasks, making one if none is idle.
+// Call with the pool's lock held, which is dropped. Returns 0, or an errno value if no runner could be made
+int wakeRunner(Schedular * s) {
+	return claimRunner(s) ? spawnRunner(s) : 0;
+}
+
+// The running runner is blocking in its task. Called by blockThread while it still holds the lock it blocks
+// under, so a new runner isn't made here. Returns 1 if blockThread has to make one with spawnRunner once switched out
+int taskBlocked(Schedular * s) {
+
+	spinLock(&taskPool.lock);
+	taskPool.numAwake--;
+
+	// Don't leave the queue stranded behind us
+	if (taskPool.head != NULL && taskPool.numAwake < s->numWorkers) return claimRunner(s);
+	spinUnlock(&taskPool.lock);
+	return 0;
+}
+
+// The runner is back from blocking in its task
+void taskResumed(Schedular * s) {
+	spinLock(&taskPool.lock);
+	taskPool.numAwake++;
+	spinUnlock(&taskPool.lock);
+}
+
+// Wake every thread on the queue id of table
+void wakeAll(Schedular * s, IdTable * table, int id) {
+
+	SyncObject * o = (SyncObject *) idEntry(table, id);
+	spinLock(&o->lock);
+	Node * n;
+	while ((n = takeWaiter(&o->queue)) != NULL) readyThread(s, n);
+	spinUnlock(&o->lock);
+}
+
+// Record that a task has finished with value. Call with preemption disabled
+void finishTask(Schedular * s, Task * t, void * value) {
+
+	// Finishing publishes the value, and after it the future may be freed, so it is left alone
+	if (t->future != NULL) {
+		t->future->value = value;
+		int id = __atomic_exchange_n(&t->future->id, FUTURE_DONE, __ATOMIC_ACQ_REL);
+		if (id > 0) {
+			wakeAll(s, &futureTable, id);
+			idFree(&futureTable, id);
+		}
+	}
+
+	// Same for the group once its count is down. Waiters look at the count again when they wake,
+	// so a late wake through an id the group has since given back is harmless
+	if (t->group != NULL) {
+		unsigned long st = __atomic_fetch_sub(&t->group->state, 1, __ATOMIC_ACQ_REL);
+		if ((st & GROUP_PENDING) == 1 && (st >> GROUP_ID_SHIFT) != 0) wakeAll(s, &groupTable, st >> GROUP_ID_SHIFT);
+	}
+
+	slabFree(&taskPool.taskSlab, t);
+}
+
+// Body of every runner thread. Takes the oldest task and runs it, or waits on the pool for one
+void * taskRunner(void * arg) {
+
+	while (1) {
+		preemptDisable();
+		Node * self = currentWorker()->current;
+
+		spinLock(&taskPool.lock);
+		Task * t = taskPool.head;
+		if (t == NULL) {
+			// Nothing to do. Whoever queues the next task wakes us and counts us awake again
+			taskPool.numAwake--;
+			waitQueuePush(&taskPool.idle, self);
+			blockThread(schedular, &taskPool.lock, BLOCK_COND);
+			preemptEnable();
+			continue;
+		}
+		taskPool.head = t->next;
+		if (taskPool.head == NULL) taskPool.tail = NULL;
+		spinUnlock(&taskPool.lock);
+		preemptEnable();
+
+		// Run it on our stack. If it blocks, blockThread sees runningTask
+		self->thread_cb->runningTask = 1;
+		void * value = t->fn(t->arg);
+		self->thread_cb->runningTask = 0;
+
+		preemptDisable();
+		finishTask(schedular, t, value);
+		preemptEnable();
+	}
+
+	return NULL;
+}
+
+// A new id from a future or group table
+int newWaitId(IdTable * table) {
+	int id = idAlloc(table);
+	if (id == -1) {
+		perror("task wait table");
+		exit(1);
+	}
+	return id;
+}
+
+
+/************************ TASKS ****************************/
+
+
+// Queue fn(arg) to run on the task pool
+int ult_task_submit(void * (*fn)(void *), void * arg, ult_future_t * future, ult_task_group_t * group) {
+
+	if (schedularCreated == 0) initSchedular();
+
+	preemptDisable();
+
+	Task * t = (Task *) slabAlloc(&taskPool.taskSlab);
+	if (t == NULL) {
+		preemptEnable();
+		return ENOMEM;
+	}
+	t->next = NULL;
+	t->fn = fn;
+	t->arg = arg;
+	t->future = future;
+	t->group = group;
+
+	if (future != NULL) {
+		future->value = NULL;
+		future->id = 0;
+	}
+	if (group != NULL) __atomic_add_fetch(&group->state, 1, __ATOMIC_ACQ_REL);
+
+	spinLock(&taskPool.lock);
+	if (taskPool.tail == NULL) taskPool.head = t;
+	else taskPool.tail->next = t;
+	taskPool.tail = t;
+
+	// Every worker already has a runner on the queue
+	if (taskPool.numAwake >= schedular->numWorkers) {
+		spinUnlock(&taskPool.lock);
+		preemptEnable();
+		return 0;
+	}
+
+	// A runner that can't be made is fine while there is any other to take the task in the end
+	if (wakeRunner(schedular) != 0) {
+		spinLock(&taskPool.lock);
+		if (taskPool.numRunners == 0) {
+			// Nobody will run it, so take back our task alone. Others may have queued theirs meanwhile
+			Task * prev = NULL;
+			for (Task * cur = taskPool.head; cur != t; cur = cur->next) prev = cur;
+			if (prev == NULL) taskPool.head = t->next;
+			else prev->next = t->next;
+			if (taskPool.tail == t) taskPool.tail = prev;
+			spinUnlock(&taskPool.lock);
+			if (group != NULL) __atomic_sub_fetch(&group->state, 1, __ATOMIC_ACQ_REL);
+			slabFree(&taskPool.taskSlab, t);
+			preemptEnable();
+			return ENOMEM;
+		}
+		spinUnlock(&taskPool.lock);
+	}
+
+	preemptEnable();
+	return 0;
+}
+
+// Wait for the task of future to finish and return its value
+void * ult_future_get(ult_future_t * future) {
+
+	if (__atomic_load_n(&future->id, __ATOMIC_ACQUIRE) == FUTURE_DONE) return future->value;
+
+	preemptDisable();
+
+	// Give it a queue, unless another waiter has or the task has finished in the meantime
+	int id = __atomic_load_n(&future->id, __ATOMIC_ACQUIRE);
+	if (id == 0) {
+		int fresh = newWaitId(&futureTable);
+		if (__atomic_compare_exchange_n(&future->id, &id, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) id = fresh;
+		else idFree(&futureTable, fresh);
+	}
+
+	if (id != FUTURE_DONE) {
+		SyncObject * o = (SyncObject *) idEntry(&futureTable, id);
+		spinLock(&o->lock);
+
+		// The task finishes before it looks at the queue, so it can't have woken anyone yet
+		if (__atomic_load_n(&future->id, __ATOMIC_ACQUIRE) != FUTURE_DONE) parkThread(schedular, &o->queue, &o->lock, -1, BLOCK_COND);
+		else spinUnlock(&o->lock);
+	}
+
+	preemptEnable();
+	return future->value;
+}
+
+// Wait for every task of the group to finish
+int ult_task_group_wait(ult_task_group_t * group) {
+
+	unsigned long st = __atomic_load_n(&group->state, __ATOMIC_ACQUIRE);
+	if ((st & GROUP_PENDING) == 0) return 0;
+
+	preemptDisable();
+
+	// Give it a queue the first time. The last task reads it in the same op that takes the count to 0
+	int id = st >> GROUP_ID_SHIFT;
+	if (id == 0) {
+		int fresh = newWaitId(&groupTable);
+		while (id == 0 && (st & GROUP_PENDING) != 0) {
+			if (__atomic_compare_exchange_n(&group->state, &st, st | ((unsigned long) fresh << GROUP_ID_SHIFT), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) id = fresh;
+			else id = st >> GROUP_ID_SHIFT;
+		}
+		if (id != fresh) idFree(&groupTable, fresh);
+
+		// Finished while we were at it
+		if (id == 0) {
+			preemptEnable();
+			return 0;
+		}
+	}
+	SyncObject * o = (SyncObject *) idEntry(&groupTable, id);
+
+	spinLock(&o->lock);
+	while ((__atomic_load_n(&group->state, __ATOMIC_ACQUIRE) & GROUP_PENDING) != 0) {
+		parkThread(schedular, &o->queue, &o->lock, -1, BLOCK_COND);
+		spinLock(&o->lock);
+	}
+	spinUnlock(&o->lock);
+
+	preemptEnable();
+	return 0;
+}
+
+// Give the group's wait queue back
+int ult_task_group_destroy(ult_task_group_t * group) {
+
+	unsigned long st = group->state;
+	if ((st & GROUP_PENDING) != 0) return EBUSY;
+
+	int id = st >> GROUP_ID_SHIFT;
+	group->state = 0;
+	if (id != 0) {
+		preemptDisable();
+		idFree(&groupTable, id);
+		preemptEnable();
+	}
+	return 0;
+}
@@ -1,5 +1,31 @@
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "ult.h"
+
+int pthread_yield(void); // Declared by pthread.h only with _GNU_SOURCE
+
+// Scheduling policies only defined by sched.h with _GNU_SOURCE
+#ifndef SCHED_BATCH
+#define SCHED_BATCH 3
+#endif
+#ifndef SCHED_IDLE
+#define SCHED_IDLE 5
+#endif
+
+int failures = 0;
+
+// Print what a check saw next to what it expected, counting it if they differ
+void check(const char * what, long seen, long expected) {
+	printf("\t%s: %ld. %ld expected.\n", what, seen, expected);
+	if (seen != expected) failures++;
+}
 
 pthread_mutex_t mutex;
 pthread_cond_t wrt;
@@ -55,16 +81,14 @@ void * first_message() {
 	printf("\tFirst\n");
 	pthread_yield();
 	printf("\tThird\n");
-	int val = 1;
-	pthread_exit(&val);
+	pthread_exit((void *) 1);
 }
 
 void * second_message() {
 	printf("\tSecond\n");
 	pthread_yield();
 	printf("\tFourth\n");
-	int val = 2;
-	pthread_exit(&val);
+	pthread_exit((void *) 2);
 }
 
 int shared=0;
@@ -95,27 +119,331 @@ void * consumer() {
 	}while(count<10);
 }
 
+int ioPipe[2];
+int readerWaiting = 0;
+int ranWhileReading = 0;
+char pipeData[16];
+
+void * pipeReader() {
+	readerWaiting = 1;
+	return (void *) ult_read(ioPipe[0], pipeData, sizeof(pipeData));
+}
+
+void * pipeWriter() {
+	ranWhileReading = readerWaiting;
+	return (void *) ult_write(ioPipe[1], "hello", 5);
+}
+
+pthread_mutex_t timedMutex;
+pthread_cond_t timedCond;
+sem_t holderLocked; // Posted once the holder has the mutex
+sem_t holderRelease; // Posted once the timed lock has been checked
+int ranWhileSleeping = 0;
+
+// The absolute CLOCK_REALTIME time ms milliseconds from now, as timed waits take
+struct timespec realtimeIn(long ms) {
+	struct timespec t;
+	clock_gettime(CLOCK_REALTIME, &t);
+	t.tv_sec += ms / 1000;
+	t.tv_nsec += (ms % 1000) * 1000000;
+	if (t.tv_nsec >= 1000000000) {
+		t.tv_sec++;
+		t.tv_nsec -= 1000000000;
+	}
+	return t;
+}
+
+long clockMs() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+void * mutexHolder() {
+	pthread_mutex_lock(&timedMutex);
+	sem_post(&holderLocked);
+	sem_wait(&holderRelease);
+	pthread_mutex_unlock(&timedMutex);
+}
+
+void * sleepWitness() {
+	ranWhileSleeping = 1;
+}
+
+#define MANY_THREADS 1500 // More than the 1000 threads and cond. vars the library used to be limited to
+
+pthread_mutex_t manyMutex;
+pthread_cond_t manyConds[MANY_THREADS];
+int manyWaiting = 0;
+int manyReleased = 0;
+int manyDone = 0;
+
+void * manyWaiter(void * arg) {
+	pthread_mutex_lock(&manyMutex);
+	manyWaiting++;
+	while (!manyReleased) pthread_cond_wait(&manyConds[(long)arg], &manyMutex);
+	manyDone++;
+	pthread_mutex_unlock(&manyMutex);
+}
+
+// Have MANY_THREADS threads wait at once, each on its own cond. var, then release them all
+void runMany() {
+	pthread_t threads[MANY_THREADS];
+	manyWaiting = 0;
+	manyReleased = 0;
+	manyDone = 0;
+	pthread_mutex_init(&manyMutex,NULL);
+	for (long i = 0; i < MANY_THREADS; i++) {
+		pthread_cond_init(&manyConds[i],NULL);
+		pthread_create(&threads[i], NULL, &manyWaiter, (void *) i);
+	}
+
+	pthread_mutex_lock(&manyMutex);
+	while (manyWaiting < MANY_THREADS) {
+		pthread_mutex_unlock(&manyMutex);
+		pthread_yield();
+		pthread_mutex_lock(&manyMutex);
+	}
+	check("Threads waiting at once", manyWaiting, MANY_THREADS);
+	manyReleased = 1;
+	for (int i = 0; i < MANY_THREADS; i++) pthread_cond_signal(&manyConds[i]);
+	pthread_mutex_unlock(&manyMutex);
+
+	for (int i = 0; i < MANY_THREADS; i++) pthread_join(threads[i],NULL);
+	for (int i = 0; i < MANY_THREADS; i++) pthread_cond_destroy(&manyConds[i]);
+	check("Threads finished", manyDone, MANY_THREADS);
+}
+
+pthread_rwlock_t rwlock;
+int readersIn = 0;
+
+void * rwReader() {
+	pthread_rwlock_rdlock(&rwlock);
+	readersIn++;
+	pthread_rwlock_unlock(&rwlock);
+}
+
+#define BARRIER_THREADS 4
+
+pthread_barrier_t barrier;
+int arrived = 0;
+int sawAllArrive = 0;
+int serialThreads = 0;
+sem_t sem;
+int semWaiterDone = 0;
+
+void * barrierWaiter() {
+	arrived++;
+	if (pthread_barrier_wait(&barrier) == PTHREAD_BARRIER_SERIAL_THREAD) serialThreads++;
+	if (arrived == BARRIER_THREADS) sawAllArrive++;
+}
+
+void * semWaiter() {
+	sem_wait(&sem);
+	semWaiterDone = 1;
+}
+
+pthread_key_t key;
+long destroyedSum = 0;
+
+void keyDestructor(void * value) {
+	destroyedSum += (long) value;
+}
+
+void * keyUser(void * arg) {
+	pthread_setspecific(key, arg);
+	pthread_yield();
+	return pthread_getspecific(key);
+}
+
+#define NUM_TASKS 10
+
+pthread_mutex_t taskMutex;
+long taskSum = 0;
+
+void * square(void * arg) {
+	return (void *) ((long) arg * (long) arg);
+}
+
+void * addToSum(void * arg) {
+	pthread_mutex_lock(&taskMutex);
+	pthread_yield();
+	taskSum += (long) arg;
+	pthread_mutex_unlock(&taskMutex);
+	return NULL;
+}
+
+ult_chan_t * chan;
+
+void * chanSender() {
+	for (int i = 1; i <= 5; i++) ult_chan_send(chan, &i);
+	ult_chan_close(chan);
+}
+
+void * detachedThread() {
+	return (void *) 1;
+}
+
+sem_t detachGate;
+
+// Stays alive until the checks on a live detached thread are done
+void * gatedThread() {
+	sem_wait(&detachGate);
+	return (void *) 1;
+}
+
+#define DEEP_CALLS 500 // About 600 KB of stack, well past the default reserve
+
+long deepSum(long depth) {
+	volatile long frame[128];
+	frame[0] = depth;
+	if (depth == 0) return 0;
+	return frame[0] + deepSum(depth - 1);
+}
+
+void * deepThread() {
+	return (void *) deepSum(DEEP_CALLS);
+}
+
+void * trimmedSleeper() {
+	volatile long frame[1024];
+	for (long i = 0; i < 1024; i++) frame[i] = i;
+	struct timespec nap = { 0, 30000000 };
+	ult_nanosleep(&nap, NULL);
+	for (long i = 0; i < 1024; i++) if (frame[i] != i) return (void *) 0;
+	return (void *) 1;
+}
+
+pthread_mutex_t policyMutex;
+
+void * policyWaiter() {
+	pthread_mutex_lock(&policyMutex);
+	pthread_mutex_unlock(&policyMutex);
+	return NULL;
+}
+
+// Unlock policyMutex with a thread waiting for it ten times, counting the times the unlocker could take it straight back
+long retakenAfterUnlock() {
+	long retaken = 0;
+	for (int i = 0; i < 10; i++) {
+		pthread_t t;
+		struct ult_thread_stats stats;
+		pthread_mutex_lock(&policyMutex);
+		pthread_create(&t, NULL, &policyWaiter, NULL);
+
+		// Its first block is on the mutex queue
+		while (ult_thread_stats(t, &stats) == 0 && stats.blocks == 0) pthread_yield();
+		pthread_mutex_unlock(&policyMutex);
+		if (pthread_mutex_trylock(&policyMutex) == 0) {
+			retaken++;
+			pthread_mutex_unlock(&policyMutex);
+		}
+		pthread_join(t,NULL);
+	}
+	return retaken;
+}
+
+#define MAX_SPINNERS 65 // One more than the library's most workers
+#define SPIN_LIMIT_MS 2000 // Spinners give up after this long, so a failure can't hang the test
+
+int numSpinners = 0;
+int spinnersStarted = 0;
+long spinnerPreemptions = 0;
+
+// Spin until every spinner has started. With more spinners than workers only preemption gets them all going
+void * spinner() {
+	__atomic_add_fetch(&spinnersStarted, 1, __ATOMIC_SEQ_CST);
+	long start = clockMs();
+	while (__atomic_load_n(&spinnersStarted, __ATOMIC_SEQ_CST) < numSpinners && clockMs() - start < SPIN_LIMIT_MS);
+	struct ult_thread_stats stats;
+	ult_thread_stats(pthread_self(), &stats);
+	__atomic_add_fetch(&spinnerPreemptions, stats.preemptions, __ATOMIC_SEQ_CST);
+	return (void *) (long) (__atomic_load_n(&spinnersStarted, __ATOMIC_SEQ_CST) == numSpinners);
+}
+
+long runOrder = 0;
+int idleRan = 0;
+
+void * orderedThread(void * arg) {
+	runOrder = runOrder * 10 + (long) arg;
+	return NULL;
+}
+
+void * idleThread() {
+	__atomic_store_n(&idleRan, 1, __ATOMIC_SEQ_CST);
+	return NULL;
+}
+
+// Spin until the idle priority thread has run. On one worker that takes dropping to its level
+void * demotedSpinner() {
+	long start = clockMs();
+	while (!__atomic_load_n(&idleRan, __ATOMIC_SEQ_CST) && clockMs() - start < SPIN_LIMIT_MS);
+	return (void *) (long) __atomic_load_n(&idleRan, __ATOMIC_SEQ_CST);
+}
+
+#define STEAL_THREADS 8
+
+long stealTids[STEAL_THREADS]; // Kernel thread each ran on
+
+// Note the kernel thread we run on, then spin until one of the others has run on another. Created threads
+// start on their creator's worker, so that only happens if another worker steals them
+void * stealer(void * arg) {
+	long tid = syscall(SYS_gettid);
+	__atomic_store_n(&stealTids[(long)arg], tid, __ATOMIC_SEQ_CST);
+	long start = clockMs();
+	while (clockMs() - start < SPIN_LIMIT_MS) {
+		for (int i = 0; i < STEAL_THREADS; i++) {
+			long other = __atomic_load_n(&stealTids[i], __ATOMIC_SEQ_CST);
+			if (other != 0 && other != tid) return NULL;
+		}
+	}
+	return NULL;
+}
+
+#define CV_WAITERS 4
+
+pthread_mutex_t cvMutex;
+pthread_cond_t cvCond;
+int cvWaiting = 0;
+int cvReleased = 0;
+long waitOrder = 0; // Digits of the waiters in the order they first waited, which workers may shuffle
+long wakeOrder = 0;
+
+void * cvWaiter(void * arg) {
+	pthread_mutex_lock(&cvMutex);
+	cvWaiting++;
+	waitOrder = waitOrder * 10 + (long) arg;
+	while (!cvReleased) pthread_cond_wait(&cvCond, &cvMutex);
+	wakeOrder = wakeOrder * 10 + (long) arg;
+	pthread_mutex_unlock(&cvMutex);
+}
+
 void main(void) {
 
-	pthread_t t1,t2,w1,r1,r2,r3,r4,pct1,pct2;
+	pthread_t t1,t2,w1,r1,r2,r3,r4,pct1,pct2,io1,io2,tw1,rw1,bt[BARRIER_THREADS],cvt[CV_WAITERS],spt[MAX_SPINNERS];
+
+	// Workers ULT_WORKERS starts the library with, up to its 64
+	char * env = getenv("ULT_WORKERS");
+	int started = env != NULL && atoi(env) > 1 ? atoi(env) : 1;
+	if (started > 64) started = 64;
 
 	printf("Threading Proof of Concept\n");
 	pthread_create(&t1, NULL, &first_message, NULL);
 	pthread_create(&t2, NULL, &second_message, NULL);
 	printf("\tStarting...\n");
-	int* val1;
-	pthread_join(t1,(void**)&(val1));
-	printf("\tThread 1 val: %d\n",*val1);
-	int* val2;
-	pthread_join(t2,(void**)&(val2));
-	printf("\tThread 2 val: %d\n",*val2);
+	void* val1;
+	pthread_join(t1,&val1);
+	printf("\tThread 1 val: %d\n",(int)(long)val1);
+	void* val2;
+	pthread_join(t2,&val2);
+	printf("\tThread 2 val: %d\n",(int)(long)val2);
 	printf("Above, you should have seen Starting followed by First, Second, Third, and Fourth printed out in order.\n");
-	printf("The expected values are 1 and 2, the same as their thread ids.\n");
+	printf("The expected values are 1 and 2, the values the threads passed to pthread_exit.\n");
 
 
 	printf("\n\n\nProducer-Consumer Problem\n");
 
-	pthread_mutex_init(&pcm);
+	pthread_mutex_init(&pcm,NULL);
 
 	pthread_create(&pct1,NULL,&producer,NULL);
 	pthread_create(&pct2,NULL,&consumer,NULL);
@@ -146,7 +474,347 @@ void main(void) {
 	pthread_join(r4,NULL);
 
 	printf("Readers-Writers problem completed.\n");
+
+
+	printf("\n\n\nBlocking I/O\n");
+	printf("The reader waits on an empty pipe, which must leave the writer free to run.\n");
+
+	pipe(ioPipe);
+	void* nread;
+	void* nwritten;
+	pthread_create(&io1, NULL, &pipeReader, NULL);
+	pthread_create(&io2, NULL, &pipeWriter, NULL);
+	pthread_join(io1,&nread);
+	pthread_join(io2,&nwritten);
+	check("Bytes written", (long)nwritten, 5);
+	check("Bytes read", (long)nread, 5);
+	check("Data matches", memcmp(pipeData, "hello", 5) == 0, 1);
+	check("Writer ran while the reader waited", ranWhileReading, 1);
+	ult_close(ioPipe[0]);
+	ult_close(ioPipe[1]);
+
+	printf("\n\n\nTimed Waits and Sleeps\n");
+	printf("Nothing signals the cond. var and the mutex is held for longer than the wait, so both time out.\n");
+
+	pthread_mutex_init(&timedMutex,NULL);
+	pthread_cond_init(&timedCond,NULL);
+	struct timespec deadline = realtimeIn(20);
+	pthread_mutex_lock(&timedMutex);
+	check("pthread_cond_timedwait", pthread_cond_timedwait(&timedCond, &timedMutex, &deadline), ETIMEDOUT);
+	check("Mutex held after the timeout", pthread_mutex_trylock(&timedMutex), EBUSY);
+	pthread_mutex_unlock(&timedMutex);
+
+	sem_init(&holderLocked, 0, 0);
+	sem_init(&holderRelease, 0, 0);
+	pthread_create(&tw1, NULL, &mutexHolder, NULL);
+	sem_wait(&holderLocked);
+	deadline = realtimeIn(20);
+	check("pthread_mutex_timedlock", pthread_mutex_timedlock(&timedMutex, &deadline), ETIMEDOUT);
+	sem_post(&holderRelease);
+	pthread_join(tw1,NULL);
+	sem_destroy(&holderLocked);
+	sem_destroy(&holderRelease);
+	deadline = realtimeIn(20);
+	check("pthread_mutex_timedlock once freed", pthread_mutex_timedlock(&timedMutex, &deadline), 0);
+	pthread_mutex_unlock(&timedMutex);
+
+	pthread_create(&tw1, NULL, &sleepWitness, NULL);
+	long start = clockMs();
+	struct timespec nap = { 0, 30000000 };
+	check("ult_nanosleep", ult_nanosleep(&nap, NULL), 0);
+	check("Slept at least 30 ms", clockMs() - start >= 30, 1);
+	check("Another thread ran while sleeping", ranWhileSleeping, 1);
+	check("ult_sleep(0)", ult_sleep(0), 0);
+	pthread_join(tw1,NULL);
+
+	printf("\n\n\nMany Threads\n");
+	printf("%d threads wait at the same time, each on a cond. var of its own.\n", MANY_THREADS);
+
+	runMany();
+
+
+	printf("\n\n\nRead-Write Locks\n");
+	printf("Readers share the lock while a writer has to wait, and a writer keeps everyone else out.\n");
+
+	pthread_rwlock_init(&rwlock,NULL);
+	check("pthread_rwlock_rdlock", pthread_rwlock_rdlock(&rwlock), 0);
+	check("pthread_rwlock_tryrdlock while read locked", pthread_rwlock_tryrdlock(&rwlock), 0);
+	check("pthread_rwlock_trywrlock while read locked", pthread_rwlock_trywrlock(&rwlock), EBUSY);
+	pthread_create(&rw1, NULL, &rwReader, NULL);
+	pthread_join(rw1,NULL);
+	check("Readers let in alongside", readersIn, 1);
+	pthread_rwlock_unlock(&rwlock);
+	pthread_rwlock_unlock(&rwlock);
+
+	check("pthread_rwlock_wrlock", pthread_rwlock_wrlock(&rwlock), 0);
+	check("pthread_rwlock_tryrdlock while write locked", pthread_rwlock_tryrdlock(&rwlock), EBUSY);
+	check("pthread_rwlock_trywrlock while write locked", pthread_rwlock_trywrlock(&rwlock), EBUSY);
+	deadline = realtimeIn(20);
+	check("pthread_rwlock_timedrdlock while write locked", pthread_rwlock_timedrdlock(&rwlock, &deadline), ETIMEDOUT);
+	pthread_create(&rw1, NULL, &rwReader, NULL);
+	pthread_yield();
+	check("Readers let in while write locked", readersIn, 1);
+	pthread_rwlock_unlock(&rwlock);
+	pthread_join(rw1,NULL);
+	check("Readers let in once unlocked", readersIn, 2);
+	check("pthread_rwlock_destroy", pthread_rwlock_destroy(&rwlock), 0);
+
+
+	printf("\n\n\nBarriers and Semaphores\n");
+	printf("No thread leaves the barrier before all have arrived, and just one is told it is the serial thread.\n");
+
+	pthread_barrier_init(&barrier, NULL, BARRIER_THREADS);
+	for (int i = 0; i < BARRIER_THREADS; i++) pthread_create(&bt[i], NULL, &barrierWaiter, NULL);
+	for (int i = 0; i < BARRIER_THREADS; i++) pthread_join(bt[i],NULL);
+	check("Threads that saw all arrive", sawAllArrive, BARRIER_THREADS);
+	check("Serial threads", serialThreads, 1);
+	check("pthread_barrier_destroy", pthread_barrier_destroy(&barrier), 0);
+
+	int semValue;
+	sem_init(&sem, 0, 2);
+	check("First sem_trywait", sem_trywait(&sem), 0);
+	check("Second sem_trywait", sem_trywait(&sem), 0);
+	check("Third sem_trywait", sem_trywait(&sem) == -1 && errno == EAGAIN, 1);
+	pthread_create(&tw1, NULL, &semWaiter, NULL);
+	pthread_yield();
+	check("Waiter done before sem_post", semWaiterDone, 0);
+	sem_post(&sem);
+	pthread_join(tw1,NULL);
+	check("Waiter done after sem_post", semWaiterDone, 1);
+	sem_getvalue(&sem, &semValue);
+	check("sem_getvalue", semValue, 0);
+	check("sem_destroy", sem_destroy(&sem), 0);
+
+
+	printf("\n\n\nThread-Specific Data\n");
+	printf("Each thread sees only its own value for the key, and the destructor gets each value as its thread exits.\n");
+
+	pthread_key_create(&key, &keyDestructor);
+	check("pthread_getspecific before any set", (long)pthread_getspecific(key), 0);
+	pthread_create(&t1, NULL, &keyUser, (void *) 10);
+	pthread_create(&t2, NULL, &keyUser, (void *) 20);
+	pthread_join(t1,&val1);
+	pthread_join(t2,&val2);
+	check("Thread 1 value", (long)val1, 10);
+	check("Thread 2 value", (long)val2, 20);
+	check("Sum passed to the destructor", destroyedSum, 30);
+	check("pthread_key_delete", pthread_key_delete(key), 0);
+
+
+	printf("\n\n\nTasks\n");
+	printf("A future gets what its task returned, and a group waits for tasks that block along the way.\n");
+
+	ult_future_t future;
+	ult_task_group_t group = ULT_TASK_GROUP_INITIALIZER;
+	check("ult_task_submit", ult_task_submit(&square, (void *) 7, &future, NULL), 0);
+	check("ult_future_get", (long)ult_future_get(&future), 49);
+	pthread_mutex_init(&taskMutex,NULL);
+	for (long i = 1; i <= NUM_TASKS; i++) ult_task_submit(&addToSum, (void *) i, NULL, &group);
+	check("ult_task_group_wait", ult_task_group_wait(&group), 0);
+	check("Sum after the group", taskSum, NUM_TASKS * (NUM_TASKS + 1) / 2);
+	check("ult_task_group_destroy", ult_task_group_destroy(&group), 0);
+
+
+	printf("\n\n\nChannels\n");
+	printf("Values sent on an unbuffered channel all arrive, and a receive on it once closed and empty fails.\n");
+
+	int elem;
+	long received = 0;
+	ult_chan_create(&chan, sizeof(int), 0);
+	pthread_create(&t1, NULL, &chanSender, NULL);
+	while (ult_chan_recv(chan, &elem) == 0) received += elem;
+	check("Sum received", received, 15);
+	check("ult_chan_recv once closed and empty", ult_chan_recv(chan, &elem), EPIPE);
+	check("Element after EPIPE", elem, 0);
+	pthread_join(t1,NULL);
+	ult_chan_destroy(chan);
+
+	ult_chan_t * full;
+	ult_chan_t * empty;
+	ult_chan_create(&full, sizeof(int), 1);
+	ult_chan_create(&empty, sizeof(int), 1);
+	elem = 7;
+	ult_chan_send(full, &elem);
+	struct ult_select_case cases[2] = {
+		{ full, ULT_CHAN_SEND, &elem, 0 },
+		{ empty, ULT_CHAN_RECV, &elem, 0 }
+	};
+	check("ult_select with nothing ready", ult_select(cases, 2, 0), -1);
+	cases[0].op = ULT_CHAN_RECV;
+	elem = 0;
+	check("ult_select receiving from the full channel", ult_select(cases, 2, 1), 0);
+	check("Element selected", elem, 7);
+	ult_chan_close(empty);
+	check("ult_select with a closed channel", ult_select(&cases[1], 1, 1), 0);
+	check("Error of the closed case", cases[1].err, EPIPE);
+	ult_chan_destroy(full);
+	ult_chan_destroy(empty);
+
+
+	printf("\n\n\nDetached Threads\n");
+	printf("A detached thread can't be joined, and once it has exited its slot goes to another thread.\n");
+
+	sem_init(&detachGate, 0, 0);
+	pthread_create(&t1, NULL, &gatedThread, NULL);
+	check("pthread_detach", pthread_detach(t1), 0);
+	check("pthread_join of a detached thread", pthread_join(t1,NULL), EINVAL);
+	sem_post(&detachGate);
+
+	// It may exit on another worker, so wait until its slot is gone
+	struct ult_thread_stats stats;
+	for (int i = 0; i < 100000 && ult_thread_stats(t1, &stats) != ESRCH; i++) pthread_yield();
+	check("ult_thread_stats once it has exited", ult_thread_stats(t1, &stats), ESRCH);
+	check("pthread_join once it has exited", pthread_join(t1,NULL), ESRCH);
+	sem_destroy(&detachGate);
+
+	// A thread id is a slot index in the low 32 bits under the slot's generation. Freed slots are reused oldest
+	// first, so threads are made until the free list comes round to this one
+	int reused = 0;
+	for (int i = 0; i < 10000 && !reused; i++) {
+		pthread_create(&t2, NULL, &detachedThread, NULL);
+		reused = (unsigned int) t2 == (unsigned int) t1;
+		if (!reused) pthread_join(t2,NULL);
+	}
+	check("Slot reused", reused, 1);
+	check("pthread_join of the old id while its slot is reused", pthread_join(t1,NULL), ESRCH);
+	pthread_join(t2,NULL);
+
+
+	printf("\n\n\nStacks\n");
+	printf("A thread given a large stack size can go far deeper than the default allows, and trimming a blocked thread's stack keeps what it holds.\n");
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, 4 * 1024 * 1024);
+	pthread_create(&t1, &attr, &deepThread, NULL);
+	pthread_join(t1,&val1);
+	check("Sum over the deep calls", (long)val1, (long) DEEP_CALLS * (DEEP_CALLS + 1) / 2);
+	pthread_attr_destroy(&attr);
+
+	check("ult_set_stack_reserve below the minimum", ult_set_stack_reserve(1024), EINVAL);
+	check("ult_set_stack_trim", ult_set_stack_trim(1), 0);
+	pthread_create(&t1, NULL, &trimmedSleeper, NULL);
+	pthread_join(t1,&val1);
+	check("Stack intact after trimming", (long)val1, 1);
+	ult_set_stack_trim(0);
+
+
+	printf("\n\n\nBroadcast Wake Order\n");
+	printf("Threads woken by a broadcast wait for the mutex, then take it one at a time in the order they waited.\n");
+
+	pthread_mutex_init(&cvMutex,NULL);
+	pthread_cond_init(&cvCond,NULL);
+	for (long i = 0; i < CV_WAITERS; i++) pthread_create(&cvt[i], NULL, &cvWaiter, (void *) (i + 1));
+	pthread_mutex_lock(&cvMutex);
+	while (cvWaiting < CV_WAITERS) {
+		pthread_mutex_unlock(&cvMutex);
+		pthread_yield();
+		pthread_mutex_lock(&cvMutex);
+	}
+	cvReleased = 1;
+	pthread_cond_broadcast(&cvCond);
+	pthread_yield();
+	check("Waiters past the mutex before it is unlocked", wakeOrder, 0);
+	pthread_mutex_unlock(&cvMutex);
+	for (int i = 0; i < CV_WAITERS; i++) pthread_join(cvt[i],NULL);
+	check("Order the waiters took the mutex in", wakeOrder, waitOrder);
+
+
+	printf("\n\n\nMutex Policies\n");
+	printf("With handoff an unlock gives the mutex straight to its waiter. With barging it is left free for anyone to take.\n");
+
+	pthread_mutex_init(&policyMutex,NULL);
+	check("ult_set_mutex_policy with an unknown policy", ult_set_mutex_policy(-1), EINVAL);
+	check("ult_set_mutex_policy(ULT_MUTEX_HANDOFF)", ult_set_mutex_policy(ULT_MUTEX_HANDOFF), 0);
+	check("Times the unlocker took it back with handoff", retakenAfterUnlock(), 0);
+	check("ult_set_mutex_policy(ULT_MUTEX_BARGING)", ult_set_mutex_policy(ULT_MUTEX_BARGING), 0);
+	check("Unlocker took it back with barging", retakenAfterUnlock() > 0, 1);
+	ult_set_mutex_policy(ULT_MUTEX_HANDOFF);
+
+
+	printf("\n\n\nPreemption\n");
+	printf("There is one more spinning thread than workers, so the timer has to preempt them for every one to start.\n");
+
+	check("ult_set_quantum with a negative quantum", ult_set_quantum(-1, ULT_TIMER_REAL), EINVAL);
+	check("ult_set_quantum with an unknown timer", ult_set_quantum(1000, ULT_TIMER_POSIX + 1), EINVAL);
+	check("ult_set_quantum", ult_set_quantum(1000, ULT_TIMER_REAL), 0);
+	numSpinners = started + 1;
+	long sawAllStart = 0;
+	for (int i = 0; i < numSpinners; i++) pthread_create(&spt[i], NULL, &spinner, NULL);
+	for (int i = 0; i < numSpinners; i++) {
+		pthread_join(spt[i],&val1);
+		sawAllStart += (long)val1;
+	}
+	check("Spinners that saw every spinner start", sawAllStart, numSpinners);
+	check("Spinners preempted", spinnerPreemptions > 0, 1);
+	ult_set_quantum(ULT_DEFAULT_QUANTUM_US, ULT_TIMER_REAL);
+
+
+	printf("\n\n\nPriorities\n");
+	printf("A real time thread runs ahead of one created before it, and a thread that keeps using its quantum sinks\n");
+	printf("to where an idle priority thread gets to run.\n");
+
+	struct sched_param param;
+	int policy;
+	param.sched_priority = 0;
+	check("pthread_setschedparam with an unknown policy", pthread_setschedparam(pthread_self(), 99, &param), EINVAL);
+	check("pthread_setschedparam(SCHED_BATCH)", pthread_setschedparam(pthread_self(), SCHED_BATCH, &param), 0);
+	pthread_getschedparam(pthread_self(), &policy, &param);
+	check("Policy from pthread_getschedparam", policy, SCHED_BATCH);
+	pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+
+	// With more workers the two would start at the same time
+	if (started == 1) {
+		pthread_attr_t rtAttr;
+		pthread_attr_init(&rtAttr);
+		pthread_attr_setinheritsched(&rtAttr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&rtAttr, SCHED_FIFO);
+		param.sched_priority = 1;
+		pthread_attr_setschedparam(&rtAttr, &param);
+		pthread_create(&t1, NULL, &orderedThread, (void *) 2);
+		pthread_create(&t2, &rtAttr, &orderedThread, (void *) 1);
+		pthread_join(t2,NULL);
+		pthread_join(t1,NULL);
+		pthread_attr_destroy(&rtAttr);
+		check("Order the threads ran in", runOrder, 12);
+	}
+
+	// The idle thread inherits the policy main has while it creates it
+	ult_set_quantum(1000, ULT_TIMER_REAL);
+	param.sched_priority = 0;
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+	pthread_create(&t1, NULL, &idleThread, NULL);
+	pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+	pthread_create(&t2, NULL, &demotedSpinner, NULL);
+	pthread_join(t2,&val2);
+	pthread_join(t1,NULL);
+	check("Idle thread ran while another spun", (long)val2, 1);
+	ult_set_quantum(ULT_DEFAULT_QUANTUM_US, ULT_TIMER_REAL);
+
+
+	printf("\n\n\nMultiple Workers\n");
+	printf("The same again, with the threads spread over at least 4 kernel threads.\n");
+
+	// Workers can't be taken away, so ask for no fewer than ULT_WORKERS started
+	int workers = started > 4 ? started : 4;
+	check("ult_set_workers", ult_set_workers(workers), 0);
+	check("ult_set_workers with fewer workers", ult_set_workers(1), EINVAL);
+
+	pthread_t stt[STEAL_THREADS];
+	for (long i = 0; i < STEAL_THREADS; i++) pthread_create(&stt[i], NULL, &stealer, (void *) i);
+	for (int i = 0; i < STEAL_THREADS; i++) pthread_join(stt[i],NULL);
+	int kernelThreads = 0;
+	for (int i = 0; i < STEAL_THREADS; i++) {
+		int seen = 0;
+		for (int j = 0; j < i; j++) seen |= stealTids[j] == stealTids[i];
+		if (!seen) kernelThreads++;
+	}
+	check("Threads created on one worker ran on more than one kernel thread", kernelThreads > 1, 1);
+	runMany();
+
 	printf("End of test sequence.\n");
+	printf("%d checks failed. 0 expected.\n", failures);
+	exit(failures != 0);
 
 }
 
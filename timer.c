@@ -0,0 +1,301 @@
+/**
+ * timer.c
+ *
+ * This file contains the timing wheel behind ult_sleep, ult_nanosleep and the timed waits
+ *
+ * The wheel has WHEEL_LEVELS levels of WHEEL_SLOTS slots. A level 0 slot is one
+ * millisecond and a slot on any other level is a whole turn of the level below.
+ * A timer goes on the lowest level whose current turn holds its expiry and
+ * moves down a level when the wheel reaches its slot, so adding and cancelling
+ * a timer are O(1) and it moves at most WHEEL_LEVELS - 1 times.
+ *
+ * Workers move the wheel on to the current time when they look for work, so
+ * timers fire late by at most a pick or a quantum. An idle worker blocks until
+ * the next expiry.
+ */
+
+// Constants
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define MAX_EXPIRED 64 // Timers taken off the wheel before its lock is dropped to wake them
+#define MAX_TIMEOUT_SEC 100000000L // Longer timeouts are cut to this, about 3 years
+
+
+// Hierarchical timing wheel of waiting threads, linked through Node.timerNext and Node.timerPrev
+typedef struct TimingWheel {
+	SpinLock lock;
+	long now; // Millisecond the wheel has been moved on to. Its level 0 slot has been emptied
+	int count; // Timers on the wheel
+	unsigned long occupied[WHEEL_LEVELS]; // A bit per non-empty slot
+	Node * slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} TimingWheel;
+
+TimingWheel wheel;
+
+
+// Put n on the slot its expiry belongs to. Call with the wheel's lock held
+void wheelInsert(Node * n) {
+
+	// The current level 0 slot has already been emptied
+	if (n->timerExpiry <= wheel.now) n->timerExpiry = wheel.now + 1;
+
+	// The highest group of bits where the expiry and the current time differ picks the level
+	long diff = n->timerExpiry ^ wheel.now;
+	int level = 0;
+	while (level < WHEEL_LEVELS - 1 && (diff >> (WHEEL_BITS * (level + 1))) != 0) level++;
+	int i = (n->timerExpiry >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+
+	Node ** slot = &wheel.slots[level][i];
+	n->timerPrev = NULL;
+	n->timerNext = *slot;
+	if (*slot != NULL) (*slot)->timerPrev = n;
+	*slot = n;
+	n->timerSlot = slot;
+
+	wheel.occupied[level] |= 1UL << i;
+	wheel.count++;
+}
+
+// Take n off the wheel. Call with the wheel's lock held
+void wheelRemove(Node * n) {
+
+	Node ** slot = n->timerSlot;
+	if (n->timerPrev == NULL) *slot = n->timerNext;
+	else n->timerPrev->timerNext = n->timerNext;
+	if (n->timerNext != NULL) n->timerNext->timerPrev = n->timerPrev;
+	n->timerSlot = NULL;
+
+	if (*slot == NULL) {
+		int i = slot - &wheel.slots[0][0];
+		wheel.occupied[i / WHEEL_SLOTS] &= ~(1UL << (i % WHEEL_SLOTS));
+	}
+	wheel.count--;
+}
+
+// Move the wheel on to millisecond to, taking off up to max expired timers and the waits they belong to.
+// Call with the wheel's lock held. Returns how many were taken. If that is max there may be more
+int advanceWheel(long to, Node ** expired, unsigned int * waits, int max) {
+
+	int n = 0;
+
+	while (1) {
+
+		// Everything on the current level 0 slot is due
+		Node ** slot = &wheel.slots[0][wheel.now & (WHEEL_SLOTS - 1)];
+		while (*slot != NULL) {
+			if (n == max) return n;
+			Node * temp = *slot;
+			wheelRemove(temp);
+			expired[n] = temp;
+			waits[n] = temp->timerWait;
+			n++;
+		}
+
+		if (wheel.now >= to) return n;
+
+		// Nothing left to fire on the way
+		if (wheel.count == 0) {
+			wheel.now = to;
+			return n;
+		}
+
+		// Skip empty level 0 slots up to the end of the turn, where the next level has to move down
+		if (wheel.occupied[0] == 0) {
+			long end = wheel.now | (WHEEL_SLOTS - 1);
+			wheel.now = end < to ? end : to;
+			if (wheel.now == to) continue;
+		}
+
+		wheel.now++;
+
+		// Starting a new turn of a level moves the matching slot of the level above down
+		int level;
+		for (level = 1; level < WHEEL_LEVELS; level++) {
+			if ((wheel.now & ((1L << (WHEEL_BITS * level)) - 1)) != 0) break;
+
+			int i = (wheel.now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+			Node * temp = wheel.slots[level][i];
+			while (temp != NULL) {
+				Node * next = temp->timerNext;
+				wheelRemove(temp);
+				wheelInsert(temp);
+				temp = next;
+			}
+		}
+	}
+}
+
+// The timer won the race for n's wait, if it is still the wait it was set for. Make n runnable
+void expireTimer(Schedular * s, Node * n, unsigned int wait) {
+
+	// A waker got there first. It may already be running again or even gone
+	unsigned int st = wait;
+	if ((st & WAIT_STATE_MASK) != WAIT_WAITING || !__atomic_compare_exchange_n(&n->waitState, &st, (st & ~WAIT_STATE_MASK) | WAIT_TIMEDOUT, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) return;
+
+	// Taking its lock waits until it is switched out. Nobody else will take it off its queue now
+	spinLock(n->waitLock);
+	if (n->waitQueue != NULL) {
+		waitQueueRemove(n->waitQueue, n);
+		n->waitQueue = NULL;
+	}
+	spinUnlock(n->waitLock);
+
+	readyThread(s, n);
+	__atomic_sub_fetch(&s->numTimed, 1, __ATOMIC_SEQ_CST);
+}
+
+// Put n on the wheel to time out its current wait at the monotonic millisecond expiry.
+// Call before blocking, with the lock of the queue it waits on held
+void addTimer(Schedular * s, Node * n, long expiry) {
+
+	__atomic_add_fetch(&s->numTimed, 1, __ATOMIC_SEQ_CST);
+
+	spinLock(&wheel.lock);
+
+	// An empty wheel may be far behind. Catch up without walking the slots in between
+	if (wheel.count == 0) {
+		long now = monotonicMs();
+		if (now > wheel.now) wheel.now = now;
+	}
+
+	n->timerExpiry = expiry;
+	n->timerWait = n->waitState;
+	wheelInsert(n);
+
+	spinUnlock(&wheel.lock);
+}
+
+// Take n's timer off the wheel after a waker has woken it
+void cancelTimer(Schedular * s, Node * n) {
+
+	spinLock(&wheel.lock);
+	if (n->timerSlot != NULL) wheelRemove(n);
+	spinUnlock(&wheel.lock);
+
+	__atomic_sub_fetch(&s->numTimed, 1, __ATOMIC_SEQ_CST);
+}
+
+// Wake every thread whose timer is due. Call holding no wait queue lock
+void runTimers(Schedular * s) {
+
+	if (wheel.count == 0) return;
+
+	long now = monotonicMs();
+	if (now <= wheel.now && wheel.slots[0][wheel.now & (WHEEL_SLOTS - 1)] == NULL) return;
+
+	Node * expired[MAX_EXPIRED];
+	unsigned int waits[MAX_EXPIRED];
+	int n;
+
+	// The queue locks are taken without the wheel's, so a waiter can add its timer while holding one
+	do {
+		spinLock(&wheel.lock);
+		n = advanceWheel(now, expired, waits, MAX_EXPIRED);
+		spinUnlock(&wheel.lock);
+
+		int i;
+		for (i = 0; i < n; i++) expireTimer(s, expired[i], waits[i]);
+	} while (n == MAX_EXPIRED);
+}
+
+// Milliseconds until the next timer is due or has to move down a level, 0 if one is due, -1 if there are none
+int nextTimerDelay(Schedular * s) {
+
+	if (wheel.count == 0) return -1;
+
+	long next = -1;
+
+	spinLock(&wheel.lock);
+	int level;
+	for (level = 0; level < WHEEL_LEVELS && next == -1; level++) {
+		if (wheel.occupied[level] == 0) continue;
+
+		// Earlier levels are due before this one moves down, so the first set slot is the answer
+		int shift = WHEEL_BITS * level;
+		int i = (wheel.now >> shift) & (WHEEL_SLOTS - 1);
+		int d;
+		for (d = level == 0 ? 0 : 1; d <= WHEEL_SLOTS; d++) {
+			if (wheel.occupied[level] & (1UL << ((i + d) & (WHEEL_SLOTS - 1)))) {
+				next = ((wheel.now >> shift) + d) << shift;
+				break;
+			}
+		}
+	}
+	spinUnlock(&wheel.lock);
+
+	if (next == -1) return -1;
+
+	long delay = next - monotonicMs();
+	if (delay < 0) return 0;
+	if (delay > 1000000000L) return 1000000000;
+	return (int) delay;
+}
+
+// Monotonic deadline in milliseconds for a timeout of sec seconds and nsec nanoseconds from now, rounded up
+long deadlineIn(long sec, long nsec) {
+
+	if (sec > MAX_TIMEOUT_SEC) sec = MAX_TIMEOUT_SEC;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	long ns = (now.tv_sec + sec) * 1000000000L + now.tv_nsec + nsec;
+	return (ns + 999999) / 1000000;
+}
+
+// Monotonic deadline in milliseconds for an absolute CLOCK_REALTIME time, as pthread timed waits take
+long realtimeDeadline(const struct timespec * abstime) {
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	return deadlineIn(abstime->tv_sec - now.tv_sec, abstime->tv_nsec - now.tv_nsec);
+}
+
+// Park the calling thread until the monotonic deadline in milliseconds
+void sleepUntil(Schedular * s, long deadline) {
+
+	preemptDisable();
+
+	Node * self = currentWorker()->current;
+
+	// Nothing else will take it, but holding it until we are switched out keeps the timer from waking us early
+	spinLock(&self->parkLock);
+	parkThread(s, NULL, &self->parkLock, deadline, BLOCK_SLEEP);
+
+	preemptEnable();
+}
+
+
+/************************ SLEEP ****************************/
+
+
+// Sleep the calling thread for seconds. Returns 0, as sleep does when it is not interrupted
+unsigned int ult_sleep(unsigned int seconds) {
+
+	if (schedularCreated == 0) initSchedular();
+
+	sleepUntil(schedular, deadlineIn(seconds, 0));
+	return 0;
+}
+
+// Sleep the calling thread for req. Returns 0, or -1 with errno EINVAL if req is not a valid time
+int ult_nanosleep(const struct timespec * req, struct timespec * rem) {
+
+	if (req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec >= 1000000000L) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (schedularCreated == 0) initSchedular();
+
+	sleepUntil(schedular, deadlineIn(req->tv_sec, req->tv_nsec));
+
+	// Never interrupted, so nothing remains
+	if (rem != NULL) {
+		rem->tv_sec = 0;
+		rem->tv_nsec = 0;
+	}
+	return 0;
+}
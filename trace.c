@@ -0,0 +1,146 @@
+/**
+ * trace.c
+ *
+ * This file contains ult_thread_stats and the dump of the scheduling trace
+ *
+ * The counters and the per-worker trace rings are kept by schedular.c. The
+ * rings, and the times in the counters, are only compiled in by make TRACE=1
+ * (ULT_TRACE), so a normal build pays nothing for them. The dump is Chrome
+ * trace JSON, which chrome://tracing and Perfetto open: one row per worker,
+ * a slice per run of a thread and a marker per block, wake, create and exit.
+ */
+
+// Names of the BLOCK_* kinds in the trace
+const char * blockNames[NUM_BLOCK_KINDS] = { "none", "mutex", "cond", "join", "io", "sleep" };
+
+// ULT_TRACE_FILE, dumped to when the process exits
+char * traceFile = NULL;
+
+
+// Copy the counters of a live thread. Returns 0 or ESRCH
+int ult_thread_stats(pthread_t thread, struct ult_thread_stats * stats) {
+
+	if (schedularCreated == 0) initSchedular();
+
+	ThreadSlot * slot = threadSlot(schedular, thread);
+	if (slot == NULL) return ESRCH;
+
+	preemptDisable();
+	spinLock(&slot->lock);
+	if (slot->state != SLOT_LIVE || slot->gen != (unsigned int) (thread >> THREAD_SLOT_BITS)) {
+		spinUnlock(&slot->lock);
+		preemptEnable();
+		return ESRCH;
+	}
+
+	TCB * t = slot->node->thread_cb;
+	memset(stats, 0, sizeof(*stats));
+	stats->switches = t->numSwitches;
+	stats->yields = t->numYields;
+	stats->preemptions = t->numPreempted;
+	stats->blocks = t->numBlocks;
+
+#ifdef ULT_TRACE
+	stats->run_ns = t->runNs;
+	stats->ready_ns = t->readyNs;
+	stats->mutex_ns = t->blockedNs[BLOCK_MUTEX];
+	stats->cond_ns = t->blockedNs[BLOCK_COND];
+	stats->join_ns = t->blockedNs[BLOCK_JOIN];
+	stats->io_ns = t->blockedNs[BLOCK_IO];
+	stats->sleep_ns = t->blockedNs[BLOCK_SLEEP];
+
+	// The caller's current run isn't counted until it is switched out
+	if (slot->node == currentWorker()->current) stats->run_ns += traceNs() - t->lastEventNs;
+#endif
+
+	spinUnlock(&slot->lock);
+	preemptEnable();
+	return 0;
+}
+
+
+#ifdef ULT_TRACE
+// Write one instant event
+void dumpInstant(FILE * f, int worker, TraceEvent * e, const char * name, const char * kind) {
+	fprintf(f, ",\n{\"name\":\"%s%s%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"args\":{\"thread\":%lu,\"by\":%lu}}",
+		name, kind != NULL ? " " : "", kind != NULL ? kind : "", worker, e->ns / 1000.0, e->thread, e->other);
+}
+
+// Write the events on w's ring, oldest first
+void dumpWorker(FILE * f, Worker * w) {
+
+	fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"worker %d\"}}", w->id, w->id);
+
+	unsigned long head = __atomic_load_n(&w->traceHead, __ATOMIC_ACQUIRE);
+	unsigned long i = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+	// A thread's run is the time between the switch to it and the next switch on the same worker
+	pthread_t running = 0;
+	long since = 0;
+
+	for (; i < head; i++) {
+		TraceEvent * e = &w->trace[i % TRACE_RING_SIZE];
+
+		switch (e->type) {
+		case TRACE_SWITCH:
+			if (running != 0) {
+				fprintf(f, ",\n{\"name\":\"thread %lu\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"thread\":%lu}}",
+					running, w->id, since / 1000.0, (e->ns - since) / 1000.0, running);
+			}
+			running = e->other;
+			since = e->ns;
+			break;
+		case TRACE_BLOCK:
+			dumpInstant(f, w->id, e, "block", blockNames[e->arg]);
+			break;
+		case TRACE_WAKE:
+			dumpInstant(f, w->id, e, "wake", blockNames[e->arg]);
+			break;
+		case TRACE_CREATE:
+			dumpInstant(f, w->id, e, "create", NULL);
+			break;
+		case TRACE_EXIT:
+			dumpInstant(f, w->id, e, "exit", NULL);
+			break;
+		}
+	}
+}
+#endif
+
+// Write the trace rings of every worker to path as Chrome trace JSON. Workers keep recording while it is written,
+// so the newest events may be cut short. Returns 0, ENOSYS if the library was built without TRACE=1, or an errno value
+int ult_trace_dump(const char * path) {
+
+#ifdef ULT_TRACE
+	if (schedularCreated == 0) initSchedular();
+
+	FILE * f = fopen(path, "w");
+	if (f == NULL) return errno;
+
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"ult\"}}");
+
+	int i;
+	for (i = 0; i < schedular->numWorkers; i++) {
+		if (schedular->workers[i] != NULL) dumpWorker(f, schedular->workers[i]);
+	}
+
+	fprintf(f, "\n]}\n");
+	if (fclose(f) != 0) return errno;
+	return 0;
+#else
+	return ENOSYS;
+#endif
+}
+
+// Dump to ULT_TRACE_FILE on the way out
+void dumpTraceAtExit(void) {
+	ult_trace_dump(traceFile);
+}
+
+// Arrange for the trace to be dumped at exit if ULT_TRACE_FILE is set
+void startTrace(void) {
+#ifdef ULT_TRACE
+	traceFile = getenv("ULT_TRACE_FILE");
+	if (traceFile != NULL) atexit(dumpTraceAtExit);
+#endif
+}
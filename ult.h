@@ -0,0 +1,151 @@
+/**
+ * ult.h
+ *
+ * This file declares the extensions the thread library adds to the pthread interface
+ */
+#ifndef ULT_H
+#define ULT_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <time.h>
+
+// Clocks that can drive preemption
+#define ULT_TIMER_REAL 0 // setitimer(ITIMER_REAL), wall clock time, SIGALRM
+#define ULT_TIMER_VIRTUAL 1 // setitimer(ITIMER_VIRTUAL), CPU time of the process, SIGVTALRM
+#define ULT_TIMER_POSIX 2 // timer_create(CLOCK_MONOTONIC), SIGALRM
+
+// What a contended pthread_mutex_unlock does with the mutex
+#define ULT_MUTEX_HANDOFF 0 // Give it to the longest waiting thread. Fair, and a woken thread always owns it
+#define ULT_MUTEX_BARGING 1 // Free it and wake a waiter that competes for it with running threads. More throughput
+
+// Preemption quantum used unless ULT_QUANTUM_US or ult_set_quantum says otherwise
+#define ULT_DEFAULT_QUANTUM_US 10000
+
+
+// Set the preemption quantum in microseconds (0 turns preemption off) and the clock that drives it.
+// The timer only runs while more threads are runnable than there are workers, or threads are parked on
+// I/O or waiting with a timeout, since its ticks also poll for those. The switch happens in the signal
+// handler, so a thread can be stopped in the middle of malloc or stdio and another thread on the same
+// worker calling them may deadlock. A shorter quantum makes that more likely. Turn preemption off, or
+// keep such calls out of threads that can be preempted, where that matters
+int ult_set_quantum(long usec, int timer);
+
+// Run green threads on n kernel threads (workers), each with its own run queue that idle workers steal from.
+// The default is 1, or ULT_WORKERS. Workers can be added at any time but not taken away
+int ult_set_workers(int n);
+
+// Choose what unlocking a mutex with waiters does, ULT_MUTEX_HANDOFF (the default) or ULT_MUTEX_BARGING.
+// ULT_MUTEX_POLICY=handoff|barging sets it at startup
+int ult_set_mutex_policy(int policy);
+
+// Reserve bytes of address space for the stack of each thread created without a stack size of its own, from
+// pthread_attr_setstacksize (64 KB by default, or ULT_STACK_RESERVE). A size set equal to glibc's default (8 MB
+// unless ulimit -s says otherwise) can't be told from no size and gets the reserve too; ask for a page more to
+// get it. Pages are only committed when the thread first touches them, so a large reserve costs an idle thread
+// just what it has used. Returns 0 or EINVAL below PTHREAD_STACK_MIN
+int ult_set_stack_reserve(size_t bytes);
+
+// Give back the stack pages below a thread's stack pointer with madvise(MADV_DONTNEED) once it has been blocked
+// for ms milliseconds, and all but the top page of stacks kept for reuse. Idle workers do it. 0, the default,
+// turns it off. ULT_STACK_TRIM_MS sets it at startup. Returns 0 or EINVAL
+int ult_set_stack_trim(long ms);
+
+// Blocking I/O that parks only the calling thread. Each puts fd in non-blocking mode and returns like the call it wraps
+ssize_t ult_read(int fd, void * buf, size_t count);
+ssize_t ult_write(int fd, const void * buf, size_t count);
+int ult_accept(int fd, struct sockaddr * addr, socklen_t * addrlen); // The new fd is non-blocking too
+int ult_connect(int fd, const struct sockaddr * addr, socklen_t addrlen);
+
+// Close an fd used with the calls above, waking any thread still waiting on it
+int ult_close(int fd);
+
+// Counters of one thread. The times are only kept when the library is built with make TRACE=1
+struct ult_thread_stats {
+	unsigned long switches; // Times it was switched in
+	unsigned long yields; // pthread_yield calls that gave way to another thread
+	unsigned long preemptions; // Times the timer gave its worker to another thread
+	unsigned long blocks; // Waits on a mutex, cond. var, join, fd or sleep
+	long run_ns; // Time running
+	long ready_ns; // Time runnable and waiting for a worker
+	long mutex_ns; // Time blocked in each kind of wait
+	long cond_ns;
+	long join_ns;
+	long io_ns;
+	long sleep_ns;
+};
+
+// Copy the counters of a live thread. Returns 0 or ESRCH
+int ult_thread_stats(pthread_t thread, struct ult_thread_stats * stats);
+
+// Write the recent scheduling events (switch, block, wake, create, exit) of every worker to path as Chrome trace
+// JSON. Needs a library built with make TRACE=1, which also dumps to ULT_TRACE_FILE at exit. Returns 0 or an errno value
+int ult_trace_dump(const char * path);
+
+// Sleep only the calling thread, to the nearest millisecond. They return like sleep and nanosleep
+unsigned int ult_sleep(unsigned int seconds);
+int ult_nanosleep(const struct timespec * req, struct timespec * rem);
+
+// The result of a task. ult_task_submit sets it up, and it must stay valid until the task has finished
+typedef struct ult_future {
+	void * value; // What the task returned
+	volatile int id; // 0 while running, -1 once finished, otherwise the queue of the threads waiting for it
+} ult_future_t;
+
+// Tasks to wait for together. Zero it, or use ULT_TASK_GROUP_INITIALIZER, before the first submit
+typedef struct ult_task_group {
+	volatile unsigned long state; // Tasks submitted and not finished in the low 32 bits, the queue of the threads waiting above
+} ult_task_group_t;
+
+#define ULT_TASK_GROUP_INITIALIZER { 0 }
+
+// Run fn(arg) as a task. Tasks run one after another on a few pooled threads and only tie one up if they block,
+// so a task that doesn't block costs a small descriptor rather than a thread. future and group may be NULL.
+// Tasks must not call pthread_exit. Returns 0 or ENOMEM
+int ult_task_submit(void * (*fn)(void *), void * arg, ult_future_t * future, ult_task_group_t * group);
+
+// Wait for a task to finish and return what it returned
+void * ult_future_get(ult_future_t * future);
+
+// Wait until every task submitted to the group has finished. Returns 0
+int ult_task_group_wait(ult_task_group_t * group);
+
+// Give back what the group used for waiting. Returns 0 or EBUSY while tasks are pending
+int ult_task_group_destroy(ult_task_group_t * group);
+
+// A channel passing elements of a fixed size between threads, by value
+typedef struct ult_chan ult_chan_t;
+
+// Operations of a select case
+#define ULT_CHAN_SEND 0
+#define ULT_CHAN_RECV 1
+
+// One of the operations ult_select chooses between
+struct ult_select_case {
+	ult_chan_t * chan; // The case is skipped if it is NULL
+	int op; // ULT_CHAN_SEND or ULT_CHAN_RECV
+	void * elem; // Element to send, or where to receive one
+	int err; // Set on the case that went ahead: 0, or EPIPE if the channel was closed
+};
+
+// Make a channel of elements of elem_size bytes that holds up to capacity of them. With capacity 0 a send waits
+// for a receiver and the element goes straight from one to the other. Returns 0 or ENOMEM
+int ult_chan_create(ult_chan_t ** chan, size_t elem_size, size_t capacity);
+
+// Free a channel. Returns 0 or EBUSY while threads wait on it
+int ult_chan_destroy(ult_chan_t * chan);
+
+// Close a channel, waking the threads waiting on it. Receivers get what is left, then EPIPE. Returns 0 or EPIPE
+int ult_chan_close(ult_chan_t * chan);
+
+// Send a copy of *elem, waiting for room. Returns 0 or EPIPE once the channel is closed
+int ult_chan_send(ult_chan_t * chan, const void * elem);
+
+// Receive an element into *elem, waiting for one. Returns 0 or EPIPE, with *elem zeroed, once closed and empty
+int ult_chan_recv(ult_chan_t * chan, void * elem);
+
+// Carry out one of the n cases that can go ahead, waiting until one can unless block is 0. A case that is
+// ready is picked round robin. Returns the index of the case, or -1 if none could go ahead
+int ult_select(struct ult_select_case * cases, int n, int block);
+
+#endif